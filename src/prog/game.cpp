@@ -379,7 +379,7 @@ void Game::prepareTurn(bool fcont) {
 }
 
 void Game::endTurn() {
-	sendb.pushHead(Com::Code::record, Com::dataHeadSize + uint16(sizeof(uint8) + sizeof(uint16) * (2 + ownRec.protects.size())));	// 2 for last actor and protects size
+	sendb.pushHead(Com::Code::record, Com::dataHeadSize + uint(sizeof(uint8) + sizeof(uint16) * (2 + ownRec.protects.size())));	// 2 for last actor and protects size
 	sendb.push(uint8(ownRec.info | (eneRec.info & Record::battleFail)));
 	sendb.push({ board->inversePieceId(ownRec.lastAct.first), uint16(ownRec.protects.size()) });
 	for (auto& [pce, prt] : ownRec.protects)
@@ -452,7 +452,7 @@ void Game::recvStart(const uint8* data) {
 
 void Game::sendSetup() {
 	uint tcnt = board->tileCompressionSize();
-	uint ofs = sendb.allocate(Com::Code::setup, uint16(Com::dataHeadSize + tcnt + pieceLim * sizeof(uint16) + board->getPieces().getNum() * sizeof(uint16)));
+	uint ofs = sendb.allocate(Com::Code::setup, uint(Com::dataHeadSize + tcnt + pieceLim * sizeof(uint16) + board->getPieces().getNum() * sizeof(uint16)));
 	std::fill_n(&sendb[ofs], tcnt, 0);
 	for (uint16 i = 0; i < board->getTiles().getExtra(); ++i)
 		sendb[i/2+ofs] |= board->compressTile(i);
@@ -141,6 +141,12 @@ bool Netcp::tickLobby() {
 		case Code::rerase:
 			prog->getState<ProgLobby>()->delRoom(readName(data + dataHeadSize));
 			break;
+		case Code::rpage:
+			prog->eventRecvRoomPage(data + dataHeadSize);
+			break;
+		case Code::rdelta:
+			prog->getState<ProgLobby>()->updateRooms(data + dataHeadSize);
+			break;
 		case Code::ropen:
 			prog->getState<ProgLobby>()->openRoom(readName(data + dataHeadSize + 1), data[dataHeadSize]);
 			break;
@@ -158,19 +164,19 @@ bool Netcp::tickLobby() {
 			prog->eventPlayerHello(true);
 			break;
 		case Code::cnjoin:
-			prog->eventJoinRoomReceive(data + dataHeadSize);
+			prog->eventJoinRoomReceive(data + readHeadSize(data));
 			break;
 		case Code::config:
-			prog->eventRecvConfig(data + dataHeadSize);
+			prog->eventRecvConfig(data + readHeadSize(data));
 			break;
 		case Code::start:
-			prog->getGame()->recvStart(data + dataHeadSize);
+			prog->getGame()->recvStart(data + readHeadSize(data));
 			break;
 		case Code::message: case Code::glmessage:
 			prog->eventRecvMessage(data);
 			break;
 		default:
-			throw Error("Invalid net code " + toStr(data[0]) + " of size " + toStr(read16(data + 1)));
+			throw Error("Invalid net code " + toStr(data[0]) + " of size " + toStr(readSize(data)));
 		}
 	if (fin)
 		throw Error(msgConnectionLost);
@@ -195,29 +201,29 @@ bool Netcp::tickGame() {
 			prog->info |= Program::INF_GUEST_WAITING;
 			break;
 		case Code::setup:
-			prog->getGame()->recvSetup(data + dataHeadSize);
+			prog->getGame()->recvSetup(data + readHeadSize(data));
 			break;
 		case Code::move:
-			prog->getGame()->recvMove(data + dataHeadSize);
+			prog->getGame()->recvMove(data + readHeadSize(data));
 			break;
 		case Code::kill:
-			prog->getGame()->recvKill(data + dataHeadSize);
+			prog->getGame()->recvKill(data + readHeadSize(data));
 			break;
 		case Code::breach:
-			prog->getGame()->recvBreach(data + dataHeadSize);
+			prog->getGame()->recvBreach(data + readHeadSize(data));
 			break;
 		case Code::tile:
-			prog->getGame()->recvTile(data + dataHeadSize);
+			prog->getGame()->recvTile(data + readHeadSize(data));
 			break;
 		case Code::record:
-			if (prog->getGame()->recvRecord(data + dataHeadSize))	// it's possible that this instance gets deleted
+			if (prog->getGame()->recvRecord(data + readHeadSize(data)))	// it's possible that this instance gets deleted
 				return true;
 			break;
 		case Code::message:
 			prog->eventRecvMessage(data);
 			break;
 		default:
-			throw Error("Invalid net code " + toStr(data[0]) + " of size " + toStr(read16(data + 1)));
+			throw Error("Invalid net code " + toStr(data[0]) + " of size " + toStr(readSize(data)));
 		}
 	if (fin)
 		throw Error(msgConnectionLost);
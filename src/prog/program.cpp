@@ -147,8 +147,35 @@ void Program::eventResetPort(Button* but) {
 
 void Program::eventOpenLobby(const uint8* data, const char* message) {
 	chatPrefix = toStr(Com::read64(data)) + ": ";
-	data += sizeof(uint64);
+	vector<pair<string, bool>> rooms = readRoomPage(data + sizeof(uint64));
+	string cursor = data[sizeof(uint64)] && !rooms.empty() ? rooms.back().first : string();
 
+	info &= ~(INF_HOST | INF_UNIQ | INF_GUEST_WAITING);
+	netcp->setTickproc(&Netcp::tickLobby);
+	setState<ProgLobby>(std::move(rooms));
+	if (message)
+		gui.openPopupMessage(message, &Program::eventClosePopup);
+	if (!cursor.empty())
+		sendRoomPageRequest(cursor);
+}
+
+void Program::eventRecvRoomPage(const uint8* data) {
+	ProgLobby* lobby = dynamic_cast<ProgLobby*>(state);
+	vector<pair<string, bool>> rooms = readRoomPage(data + sizeof(uint64));
+	if (!lobby || rooms.empty())
+		return;
+
+	for (auto& [name, open] : rooms)
+		if (!lobby->hasRoom(name)) {	// a room might've been announced before its page arrived
+			lobby->addRoom(string(name));
+			lobby->openRoom(name, open);
+		}
+	if (data[sizeof(uint64)])
+		sendRoomPageRequest(rooms.back().first);
+}
+
+vector<pair<string, bool>> Program::readRoomPage(const uint8* data) {
+	data += sizeof(uint8);	// skip whether there are more pages
 	vector<pair<string, bool>> rooms(Com::read16(data));
 	data += sizeof(uint16);
 	for (auto& [name, open] : rooms) {
@@ -156,12 +183,7 @@ void Program::eventOpenLobby(const uint8* data, const char* message) {
 		name = Com::readName(data, 0x7F);
 		data += name.length() + 1;
 	}
-
-	info &= ~(INF_HOST | INF_UNIQ | INF_GUEST_WAITING);
-	netcp->setTickproc(&Netcp::tickLobby);
-	setState<ProgLobby>(std::move(rooms));
-	if (message)
-		gui.openPopupMessage(message, &Program::eventClosePopup);
+	return rooms;
 }
 
 void Program::eventHostRoomInput(Button*) {
@@ -221,6 +243,19 @@ void Program::sendRoomName(Com::Code code, const string& name) {
 	netcp->sendData(data);
 }
 
+void Program::sendRoomPageRequest(const string& cursor) {
+	vector<uint8> data(Com::dataHeadSize + 3 + cursor.length());	// flags + cursor + empty prefix
+	data[0] = uint8(Com::Code::rpage);
+	Com::write16(data.data() + 1, uint16(data.size()));
+	data[Com::dataHeadSize + 1] = uint8(cursor.length());
+	std::copy(cursor.begin(), cursor.end(), data.data() + Com::dataHeadSize + 2);
+	try {
+		netcp->sendData(data);
+	} catch (const Com::Error& err) {
+		showLobbyError(err);
+	}
+}
+
 void Program::eventSendMessage(Button* but) {
 	Com::Code code = dynamic_cast<ProgLobby*>(state) ? Com::Code::glmessage : Com::Code::message;
 	bool inGame = dynamic_cast<ProgGame*>(state);
@@ -73,6 +73,7 @@ public:
 
 	// lobby menu
 	void eventOpenLobby(const uint8* data, const char* message = nullptr);
+	void eventRecvRoomPage(const uint8* data);
 	void eventHostRoomInput(Button* but = nullptr);
 	void eventHostRoomRequest(Button* but = nullptr);
 	void eventHostRoomReceive(const uint8* data);
@@ -230,6 +231,8 @@ public:
 
 private:
 	void sendRoomName(Com::Code code, const string& name);
+	void sendRoomPageRequest(const string& cursor);
+	static vector<pair<string, bool>> readRoomPage(const uint8* data);
 	void showLobbyError(const Com::Error& err);
 	void showGameError(const Com::Error& err);
 	void postConfigUpdate();
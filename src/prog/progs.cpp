@@ -239,13 +239,32 @@ void ProgLobby::addRoom(string&& name) {
 }
 
 void ProgLobby::delRoom(const string& name) {
-	rooms->deleteWidget(findRoom(name));
+	if (sizet id = findRoom(name); id < rooms->getWidgets().size())	// the room's page might not have been received yet
+		rooms->deleteWidget(id);
 }
 
 void ProgLobby::openRoom(const string& name, bool open) {
-	Label* le = rooms->getWidget<Label>(findRoom(name));
-	le->lcall = open ? &Program::eventJoinRoomRequest : nullptr;
-	le->setDim(open ? 1.f : GuiGen::defaultDim);
+	if (sizet id = findRoom(name); id < rooms->getWidgets().size()) {
+		Label* le = rooms->getWidget<Label>(id);
+		le->lcall = open ? &Program::eventJoinRoomRequest : nullptr;
+		le->setDim(open ? 1.f : GuiGen::defaultDim);
+	}
+}
+
+void ProgLobby::updateRooms(const uint8* data) {
+	uint16 cnt = Com::read16(data);
+	data += sizeof(uint16);
+	for (uint16 i = 0; i < cnt; ++i) {
+		string name = Com::readName(data, uint8(~(Com::roomDeltaOpen | Com::roomDeltaErase)));
+		if (*data & Com::roomDeltaErase)
+			delRoom(name);
+		else {
+			if (!hasRoom(name))
+				addRoom(string(name));
+			openRoom(name, *data & Com::roomDeltaOpen);
+		}
+		data += name.length() + 1;
+	}
 }
 
 bool ProgLobby::hasRoom(const string& name) const {
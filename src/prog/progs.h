@@ -118,6 +118,7 @@ public:
 	void addRoom(string&& name);
 	void delRoom(const string& name);
 	void openRoom(const string& name, bool open);
+	void updateRooms(const uint8* data);
 	bool hasRoom(const string& name) const;
 private:
 	 sizet findRoom(const string& name) const;
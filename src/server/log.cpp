@@ -29,6 +29,18 @@ DateTime DateTime::now() {
 
 // LOG
 
+Log::Log() :
+	ring(std::make_unique<Record[]>(ringSize)),
+	clock(time(nullptr))
+{
+	for (uint i = 0; i < ringSize; ++i)
+		ring[i].seq.store(i, std::memory_order_relaxed);
+}
+
+Log::~Log() {
+	end();
+}
+
 void Log::start(bool logStd, const char* logDir, uint maxLogs) {
 	verbose = logStd;
 	maxLogfiles = maxLogs;
@@ -38,6 +50,71 @@ void Log::start(bool logStd, const char* logDir, uint maxLogs) {
 		createDirectories(dir);
 		openFile(DateTime::now());
 	}
+	running = true;
+	writer = std::thread(&Log::run, this);
+}
+
+void Log::end() {
+	running = false;
+	if (writer.joinable())
+		writer.join();
+	flush();	// write whatever's left in case the thread never started
+	lfile.close();
+}
+
+void Log::run() {
+	while (running) {
+		clock.store(time(nullptr), std::memory_order_relaxed);
+		if (!flush())
+			std::this_thread::sleep_for(idleTime);
+	}
+	flush();
+}
+
+bool Log::flush() {
+	string cout, cerr, file;
+	time_t lastTime = 0;
+	string stamp;
+	for (;; ++tail) {
+		Record& rec = ring[tail & (ringSize - 1)];
+		if (rec.seq.load(std::memory_order_acquire) != tail + 1)
+			break;
+
+		if (verbose)
+			(rec.error ? cerr : cout).append(rec.text, rec.len) += '\n';
+		if (!dir.empty()) {
+			if (rec.time != lastTime) {	// only convert the time when it changes
+				lastTime = rec.time;
+				struct tm* tim = localtime(&lastTime);
+				DateTime now(uint8(tim->tm_sec), uint8(tim->tm_min), uint8(tim->tm_hour), uint8(tim->tm_mday), uint8(tim->tm_mon + 1), uint16(tim->tm_year + 1900), uint8(tim->tm_wday ? tim->tm_wday : 7));
+				if (!now.datecmp(lastLog)) {
+					if (!file.empty() && lfile.good())
+						lfile.write(file.c_str(), std::streamsize(file.length())).flush();
+					file.clear();
+					lfile.close();
+					openFile(now);
+				}
+				stamp = now.timeString() + ' ';
+			}
+			(file += stamp).append(rec.text, rec.len) += '\n';
+		}
+		rec.seq.store(tail + ringSize, std::memory_order_release);
+	}
+	if (uint lost = overflow.exchange(0); lost) {
+		string msg = "dropped " + toStr(lost) + " log lines\n";
+		if (verbose)
+			cerr += msg;
+		if (!dir.empty())
+			file += stamp.empty() ? msg : stamp + msg;
+	}
+
+	if (!cout.empty())
+		std::cout.write(cout.c_str(), std::streamsize(cout.length())).flush();
+	if (!cerr.empty())
+		std::cerr.write(cerr.c_str(), std::streamsize(cerr.length())).flush();
+	if (!file.empty() && lfile.good())
+		lfile.write(file.c_str(), std::streamsize(file.length())).flush();
+	return !(cout.empty() && cerr.empty() && file.empty());
 }
 
 void Log::openFile(const DateTime& now) {
@@ -62,6 +139,12 @@ void Log::openFile(const DateTime& now) {
 #endif
 }
 
+void Log::Record::append(const char* str, sizet slen) {
+	slen = std::min(slen, textLimit - sizet(len));	// cut off lines that are too long
+	std::copy_n(str, slen, text + len);
+	len += uint16(slen);
+}
+
 vector<string> Log::listLogs() const {
 	vector<string> entries;
 #ifdef _WIN32
@@ -1,8 +1,12 @@
 #pragma once
 
 #include "utils/text.h"
+#include <atomic>
+#include <chrono>
+#include <ctime>
 #include <iostream>
 #include <fstream>
+#include <thread>
 
 // struct tm wrapper
 struct DateTime {
@@ -37,56 +41,109 @@ inline bool DateTime::datecmp(const DateTime& date) const {
 	return day == date.day && month == date.month && year == date.year;
 }
 
-// for simultaneous console and file output
+// for simultaneous console and file output, where lines are queued without blocking and written by a background thread
 class Log {
 public:
 	static constexpr uint defaultMaxLogfiles = 8;
 private:
 	static constexpr char filePrefix[] = "thrones_log_";
+	static constexpr uint ringSize = 1024;	// must be a power of two
+	static constexpr uint textLimit = 496;
+	static constexpr std::chrono::milliseconds idleTime = std::chrono::milliseconds(10);
+
+	struct Record {
+		std::atomic<uint> seq;	// position at which this slot can be written to or + 1 if it's ready to be read
+		time_t time;
+		uint16 len;
+		bool error;
+		char text[textLimit];
+
+		void append(const char* str, sizet slen);
+		void append(const char* str);
+		void append(const string& str);
+		void append(char ch);
+		template <class T, std::enable_if_t<std::is_arithmetic_v<T>, int> = 0> void append(T num);
+	};
 
 	string dir;
 	std::ofstream lfile;
 	DateTime lastLog;
+	uptr<Record[]> ring;
+	std::atomic<uint> head = 0;	// next position to write to
+	uint tail = 0;				// next position to read from (only accessed by the writer thread)
+	std::atomic<uint> overflow = 0;	// lines that were dropped because the ring was full
+	std::atomic<time_t> clock;		// updated by the writer thread, so that lines don't each need to get the time
+	std::atomic<bool> running = false;
+	std::thread writer;
 	uint maxLogfiles;
 	bool verbose;
 
 public:
+	Log();
+	~Log();
+
 	void start(bool logStd, const char* logDir, uint maxLogs);
 	void end();
+	uint dropped() const;
 
 	template <class... A> void out(A&&... args);
 	template <class... A> void err(A&&... args);
 private:
-	template <class... A> void write(std::ostream& vofs, A&&... args);
+	template <class... A> void write(bool error, A&&... args);
+	void run();
+	bool flush();
 	void openFile(const DateTime& now);
 	vector<string> listLogs() const;
 };
 
-inline void Log::end() {
-	lfile.close();
+inline uint Log::dropped() const {
+	return overflow;
 }
 
 template <class... A>
 void Log::out(A&&... args) {
-	write(std::cout, std::forward<A>(args)...);
+	write(false, std::forward<A>(args)...);
 }
 
 template <class... A>
 void Log::err(A&&... args) {
-	write(std::cerr, std::forward<A>(args)...);
+	write(true, std::forward<A>(args)...);
 }
 
 template <class... A>
-void Log::write(std::ostream& vofs, A&&... args) {
-	if (verbose)
-		(vofs << ... << args) << std::endl;
-	if (!dir.empty()) {
-		DateTime now = DateTime::now();
-		if (!now.datecmp(lastLog)) {
-			lfile.close();
-			openFile(now);
-		}
-		if (lfile.good())
-			((lfile << now.timeString() << ' ') << ... << std::forward<A>(args)) << std::endl;
+void Log::write(bool error, A&&... args) {
+	Record* rec;
+	for (uint pos = head.load(std::memory_order_relaxed);;) {
+		rec = &ring[pos & (ringSize - 1)];
+		if (int dif = int(rec->seq.load(std::memory_order_acquire) - pos); !dif) {
+			if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			++overflow;
+			return;
+		} else
+			pos = head.load(std::memory_order_relaxed);
 	}
+	rec->time = clock.load(std::memory_order_relaxed);
+	rec->len = 0;
+	rec->error = error;
+	(rec->append(args), ...);
+	rec->seq.fetch_add(1, std::memory_order_release);
+}
+
+inline void Log::Record::append(const char* str) {
+	append(str, strlen(str));
+}
+
+inline void Log::Record::append(const string& str) {
+	append(str.c_str(), str.length());
+}
+
+inline void Log::Record::append(char ch) {
+	append(&ch, 1);
+}
+
+template <class T, std::enable_if_t<std::is_arithmetic_v<T>, int>>
+void Log::Record::append(T num) {
+	append(toStr(num));
 }
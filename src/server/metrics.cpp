@@ -0,0 +1,120 @@
+#include "metrics.h"
+#include "utils/text.h"
+#include <chrono>
+using namespace Com;
+
+// COUNTERS
+
+void Counters::loop(uint64 usec) {
+	bump(loops[std::lower_bound(loopBuckets.begin(), loopBuckets.end(), usec) - loopBuckets.begin()]);
+	bump(loopTime, usec);
+}
+
+// METRICS
+
+void Metrics::family(const char* name, const char* type, const char* help) {
+	text += string("# HELP ") + name + ' ' + help + "\n# TYPE " + name + ' ' + type + '\n';
+}
+
+void Metrics::sample(const char* name, const string& labels, uint64 val) {
+	text += name + (labels.empty() ? string() : '{' + labels + '}') + ' ' + toStr(val) + '\n';
+}
+
+void Metrics::sample(const char* name, const string& labels, int64 val) {
+	text += name + (labels.empty() ? string() : '{' + labels + '}') + ' ' + toStr(val) + '\n';
+}
+
+void Metrics::sample(const char* name, const string& labels, double val) {
+	text += name + (labels.empty() ? string() : '{' + labels + '}') + ' ' + toStr(val) + '\n';
+}
+
+void Metrics::counters(const vector<const Counters*>& all) {
+	array<uint64, Counters::codeCount> messages{}, bytes{};
+	uint64 sendErrors = 0, dropped = 0, timeouts = 0, accepted = 0, rejected = 0;
+	int64 rawPlayers = 0, wsPlayers = 0;
+	for (const Counters* it : all) {
+		for (uint i = 0; i < Counters::codeCount; ++i) {
+			messages[i] += it->messages[i].load(std::memory_order_relaxed);
+			bytes[i] += it->bytes[i].load(std::memory_order_relaxed);
+		}
+		sendErrors += it->sendErrors.load(std::memory_order_relaxed);
+		dropped += it->dropped.load(std::memory_order_relaxed);
+		timeouts += it->timeouts.load(std::memory_order_relaxed);
+		accepted += it->accepted.load(std::memory_order_relaxed);
+		rejected += it->rejected.load(std::memory_order_relaxed);
+		rawPlayers += it->rawPlayers.load(std::memory_order_relaxed);
+		wsPlayers += it->wsPlayers.load(std::memory_order_relaxed);
+	}
+
+	family("thrones_players", "gauge", "Players that passed the version check.");
+	sample("thrones_players", "protocol=\"raw\"", rawPlayers);
+	sample("thrones_players", "protocol=\"websocket\"", wsPlayers);
+	family("thrones_connections_accepted_total", "counter", "Accepted connections.");
+	sample("thrones_connections_accepted_total", string(), accepted);
+	family("thrones_connections_rejected_total", "counter", "Connections rejected because the server was full.");
+	sample("thrones_connections_rejected_total", string(), rejected);
+	family("thrones_messages_received_total", "counter", "Received messages by code.");
+	for (uint i = 0; i < Counters::codeCount; ++i)
+		sample("thrones_messages_received_total", string("code=\"") + codeName(i) + '"', messages[i]);
+	family("thrones_bytes_received_total", "counter", "Received message bytes without WebSocket headers by code.");
+	for (uint i = 0; i < Counters::codeCount; ++i)
+		sample("thrones_bytes_received_total", string("code=\"") + codeName(i) + '"', bytes[i]);
+	family("thrones_send_errors_total", "counter", "Failed sends to players.");
+	sample("thrones_send_errors_total", string(), sendErrors);
+	family("thrones_lobby_dropped_total", "counter", "Lobby messages skipped for players with a full send queue.");
+	sample("thrones_lobby_dropped_total", string(), dropped);
+	family("thrones_timeouts_total", "counter", "Players disconnected for not passing the version check, idling in the lobby or not answering pings.");
+	sample("thrones_timeouts_total", string(), timeouts);
+
+	family("thrones_loop_seconds", "histogram", "Time spent handling the events of one loop iteration by thread.");
+	for (sizet t = 0; t < all.size(); ++t) {
+		string thread = "thread=\"" + toStr(t) + '"';
+		uint64 cnt = 0;
+		for (uint i = 0; i < Counters::loopBuckets.size(); ++i) {
+			cnt += all[t]->loops[i].load(std::memory_order_relaxed);
+			sample("thrones_loop_seconds_bucket", thread + ",le=\"" + toStr(double(Counters::loopBuckets[i]) / 1e6) + '"', cnt);
+		}
+		cnt += all[t]->loops.back().load(std::memory_order_relaxed);
+		sample("thrones_loop_seconds_bucket", thread + ",le=\"+Inf\"", cnt);
+		sample("thrones_loop_seconds_sum", thread, double(all[t]->loopTime.load(std::memory_order_relaxed)) / 1e6);
+		sample("thrones_loop_seconds_count", thread, cnt);
+	}
+}
+
+void Metrics::answer(nsint fd, const std::atomic<bool>& running) {
+	try {
+		char req[1024];
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + requestTimeout;
+		for (string head; head.find("\r\n\r\n") == string::npos;) {	// the request itself doesn't matter
+			if (head.length() > maxRequest || !running)
+				throw Error(msgConnectionLost);
+			int wait = int(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count());
+			if (wait <= 0)
+				throw Error(msgConnectionLost);
+			pollfd pfd = { fd, POLLIN, 0 };
+			int rc = poll(&pfd, 1, std::min(wait, pollStep));
+			if (rc < 0)
+				throw Error(msgConnectionLost);
+			if (!rc)	// wake up now and then to notice a shutdown
+				continue;
+			long len = recv(fd, req, sizeof(req), 0);
+			if (len <= 0)
+				throw Error(msgConnectionLost);
+			head.append(req, sizet(len));
+		}
+		string response = "HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: " + toStr(text.length()) + "\r\n"
+			"Connection: close\r\n\r\n" + text;
+		sendData(fd, reinterpret_cast<const uint8*>(response.c_str()), uint(response.length()), false);
+	} catch (const Error&) {}
+	closeSocketV(fd);
+}
+
+const char* Metrics::codeName(uint code) {
+	constexpr array<const char*, Counters::codeCount> names = {
+		"version", "full", "rlist", "rnew", "cnrnew", "rerase", "ropen", "glmessage", "join", "leave", "thost", "kick",
+		"hello", "cnjoin", "config", "start", "setup", "move", "kill", "breach", "tile", "record", "message", "rpage", "rdelta"
+	};
+	return names[code];
+}
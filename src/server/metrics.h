@@ -0,0 +1,58 @@
+#pragma once
+
+#include "server.h"
+#include <atomic>
+#include <chrono>
+
+// statistics of one event loop that only its thread writes to, so increments don't need to lock the bus
+struct alignas(64) Counters {
+	static constexpr uint codeCount = uint(Com::Code::rdelta) + 1;
+	static constexpr array<uint, 10> loopBuckets = { 10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000 };	// upper bounds of loop iteration times in microseconds
+
+	array<std::atomic<uint64>, codeCount> messages{};	// received messages per code
+	array<std::atomic<uint64>, codeCount> bytes{};
+	array<std::atomic<uint64>, loopBuckets.size() + 1> loops{};	// iterations per bucket (not cumulative) and the rest
+	std::atomic<uint64> loopTime = 0;	// sum of iteration times in microseconds
+	std::atomic<uint64> sendErrors = 0;
+	std::atomic<uint64> dropped = 0;	// lobby messages skipped because of a full outbox
+	std::atomic<uint64> timeouts = 0;	// players disconnected by a handshake deadline, idle lobby timeout or missing pong
+	std::atomic<uint64> accepted = 0;
+	std::atomic<uint64> rejected = 0;
+	std::atomic<int64> rawPlayers = 0;	// players that passed the version check on this thread
+	std::atomic<int64> wsPlayers = 0;
+
+	void message(uint8 code, uint len);
+	void loop(uint64 usec);
+};
+
+template <class T>
+void bump(std::atomic<T>& cnt, T num = 1) {	// only safe for the owning thread
+	cnt.store(cnt.load(std::memory_order_relaxed) + num, std::memory_order_relaxed);
+}
+
+inline void Counters::message(uint8 code, uint len) {
+	if (code < codeCount) {
+		bump(messages[code]);
+		bump(bytes[code], uint64(len));
+	}
+}
+
+// builder of a response in the Prometheus text format
+class Metrics {
+private:
+	static constexpr sizet maxRequest = 4096;	// a scraper's request is a short GET
+	static constexpr std::chrono::milliseconds requestTimeout = std::chrono::milliseconds(2000);	// for reading the whole request
+	static constexpr int pollStep = 200;	// milliseconds between checks for a shutdown
+
+	string text;
+
+public:
+	void family(const char* name, const char* type, const char* help);
+	void sample(const char* name, const string& labels, uint64 val);
+	void sample(const char* name, const string& labels, int64 val);
+	void sample(const char* name, const string& labels, double val);
+	void counters(const vector<const Counters*>& all);	// adds the families that can be read from the counters of every thread
+	void answer(nsint fd, const std::atomic<bool>& running);	// responds to an HTTP request and closes the socket, gives up when running turns false
+
+	static const char* codeName(uint code);
+};
@@ -0,0 +1,512 @@
+#include "poller.h"
+#ifdef IO_URING
+#include <cassert>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#endif
+using namespace Com;
+
+// POLLER
+
+uptr<Poller> Poller::create(bool uring, string* failure) {
+#ifdef IO_URING
+	if (uring) {
+		try {
+			return std::make_unique<PollerUring>();
+		} catch (const Error& err) {
+			if (failure)
+				*failure = err.what();
+		}
+	}
+#else
+	if (uring && failure)
+		*failure = "not included in this build";
+#endif
+#ifdef EPOLL
+#ifdef EPOLL_ET
+	return std::make_unique<PollerEpoll>(true);
+#else
+	return std::make_unique<PollerEpoll>(false);
+#endif
+#else
+	return std::make_unique<PollerPoll>();
+#endif
+}
+
+bool Poller::sent(const Ready& ev, Outbox& out) {
+	if (!out.flush(ev.fd))
+		return false;
+	watchOut(ev.fd, false);
+	return true;
+}
+
+// POLLER POLL
+
+void PollerPoll::add(nsint fd, bool) {
+	if (sizet(fd) >= ids.size())
+		ids.resize(sizet(fd) + 1, UINT_MAX);
+	ids[fd] = uint(pfds.size());
+	pfds.push_back({ fd, POLLIN | POLLRDHUP, 0 });
+}
+
+void PollerPoll::del(nsint fd) {
+	if (sizet(fd) < ids.size() && ids[fd] != UINT_MAX) {
+		if (ids[fd] != pfds.size() - 1) {
+			pfds[ids[fd]] = pfds.back();
+			ids[pfds.back().fd] = ids[fd];
+		}
+		pfds.pop_back();
+		ids[fd] = UINT_MAX;
+	}
+}
+
+void PollerPoll::watchOut(nsint fd, bool on) {
+	pfds[ids.at(fd)].events = on ? POLLIN | POLLRDHUP | POLLOUT : POLLIN | POLLRDHUP;
+}
+
+const vector<Poller::Ready>& PollerPoll::wait(int timeout) {
+	ready.clear();
+	int rcp = poll(pfds.data(), ulong(pfds.size()), timeout);
+	if (rcp < 0) {
+		if (errno == EINTR)
+			return ready;
+		throw Error(msgPollFail);
+	}
+	for (vector<pollfd>::iterator it = pfds.begin(); rcp && it != pfds.end(); ++it)
+		if (it->revents) {
+			ready.push_back({ it->fd, uint8(((it->revents & POLLIN) ? EV_IN : 0) | ((it->revents & polleventsDisconnect) ? EV_DISCONNECT : 0) | ((it->revents & POLLOUT) ? EV_OUT : 0)) });
+			--rcp;
+		}
+	return ready;
+}
+
+// POLLER EPOLL
+
+#ifdef EPOLL
+PollerEpoll::PollerEpoll(bool edgeTriggered) :
+	efd(epoll_create1(EPOLL_CLOEXEC)),
+	edge(edgeTriggered),
+	events(64)
+{
+	if (efd < 0)
+		throw Error(msgPollFail);
+}
+
+PollerEpoll::~PollerEpoll() {
+	close(efd);
+}
+
+void PollerEpoll::add(nsint fd, bool drained) {
+	epoll_event ev{};
+	ev.events = EPOLLIN | EPOLLRDHUP | (edge && drained ? EPOLLET : 0u);
+	ev.data.fd = fd;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev))
+		throw Error(msgPollFail);
+}
+
+void PollerEpoll::del(nsint fd) {
+	epoll_ctl(efd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void PollerEpoll::watchOut(nsint fd, bool on) {
+	epoll_event ev{};
+	ev.events = EPOLLIN | EPOLLRDHUP | (edge ? EPOLLET : 0u) | (on ? EPOLLOUT : 0u);
+	ev.data.fd = fd;
+	if (epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev))
+		throw Error(msgPollFail);
+}
+
+const vector<Poller::Ready>& PollerEpoll::wait(int timeout) {
+	ready.clear();
+	int rcp = epoll_wait(efd, events.data(), int(events.size()), timeout);
+	if (rcp < 0) {
+		if (errno == EINTR)
+			return ready;
+		throw Error(msgPollFail);
+	}
+	for (int i = 0; i < rcp; ++i)
+		ready.push_back({ events[i].data.fd, uint8(((events[i].events & EPOLLIN) ? EV_IN : 0) | ((events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) ? EV_DISCONNECT : 0) | ((events[i].events & EPOLLOUT) ? EV_OUT : 0)) });
+	if (uint(rcp) == events.size())	// there might be more, so check more next time
+		events.resize(events.size() * 2);
+	return ready;
+}
+#endif
+
+// POLLER URING
+
+#ifdef IO_URING
+template <class T>
+static T* ringField(void* ring, uint ofs) {	// the kernel aligns the fields of the mapped ring, so going through void* doesn't hide a misaligned access
+	void* ptr = static_cast<uint8*>(ring) + ofs;
+	assert(uintptr_t(ptr) % alignof(T) == 0);
+	return static_cast<T*>(ptr);
+}
+
+PollerUring::PollerUring() :
+	blocks(recvBlocks)
+{
+	if (utsname uts; uname(&uts) || uint(std::max(atoi(uts.release), 0)) < 6)	// multishot receive needs Linux 6.0
+		throw Error("io_uring: kernel is too old");
+
+	io_uring_params params{};
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = cqEntries;
+	if (ufd = int(syscall(__NR_io_uring_setup, sqEntries, &params)); ufd < 0)
+		throw Error("io_uring: setup failed");
+	uint need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if ((params.features & need) != need) {
+		closeRing();
+		throw Error("io_uring: missing features");
+	}
+
+	sqCount = params.sq_entries;
+	ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(uint), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+	ring = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ufd, IORING_OFF_SQ_RING);
+	sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqCount * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ufd, IORING_OFF_SQES));
+	bufRing = static_cast<io_uring_buf*>(mmap(nullptr, recvBlocks * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0));
+	if (ring == MAP_FAILED || sqes == MAP_FAILED || bufRing == MAP_FAILED) {
+		closeRing();
+		throw Error("io_uring: failed to map rings");
+	}
+	const uint8* base = static_cast<const uint8*>(ring);
+	sqHead = ringField<uint>(ring, params.sq_off.head);
+	sqTail = ringField<uint>(ring, params.sq_off.tail);
+	sqMask = readMem<uint>(base + params.sq_off.ring_mask);
+	sqPos = *sqTail;
+	uint* sqArray = ringField<uint>(ring, params.sq_off.array);
+	for (uint i = 0; i < sqCount; ++i)	// submission entries are always taken in order
+		sqArray[i] = i;
+	cqHead = ringField<uint>(ring, params.cq_off.head);
+	cqTail = ringField<uint>(ring, params.cq_off.tail);
+	cqMask = readMem<uint>(base + params.cq_off.ring_mask);
+	cqes = ringField<io_uring_cqe>(ring, params.cq_off.cqes);
+
+	io_uring_buf_reg reg{};
+	reg.ring_addr = uint64(uintptr_t(bufRing));
+	reg.ring_entries = recvBlocks;
+	reg.bgid = recvGroup;
+	if (syscall(__NR_io_uring_register, ufd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		closeRing();
+		throw Error("io_uring: failed to register buffers");
+	}
+	bufRegistered = true;
+	for (uint i = 0; i < recvBlocks; ++i) {
+		blocks[i] = poolAlloc(Buffer::sizeStep);
+		provide(uint16(i));
+	}
+	__atomic_store_n(&bufRing->resv, bufTail, __ATOMIC_RELEASE);
+}
+
+PollerUring::~PollerUring() {
+	if (sendCount || std::any_of(watches.begin(), watches.end(), [](const pair<const nsint, Watch>& it) -> bool { return it.second.armed; })) {	// the kernel mustn't touch the blocks or chunks after they're gone
+		prepare(IORING_OP_ASYNC_CANCEL, -1, 0)->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+		try {
+			for (uint i = 0; i < 20 && (sendCount || std::any_of(watches.begin(), watches.end(), [](const pair<const nsint, Watch>& it) -> bool { return it.second.armed; })); ++i) {
+				enter(1, 50);
+				reap();
+			}
+		} catch (const Error&) {}
+	}
+	for (nsint fd : accepted)
+		closeSocketV(fd);
+	closeRing();
+}
+
+void PollerUring::closeRing() {
+	if (bufRegistered) {
+		io_uring_buf_reg reg{};
+		reg.bgid = recvGroup;
+		syscall(__NR_io_uring_register, ufd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	}
+	if (bufRing != MAP_FAILED)
+		munmap(bufRing, recvBlocks * sizeof(io_uring_buf));
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqCount * sizeof(io_uring_sqe));
+	if (ring != MAP_FAILED)
+		munmap(ring, ringSize);
+	close(ufd);
+}
+
+void PollerUring::add(nsint fd, bool drained) {
+	Watch& watch = watches[fd];
+	watch = { ++gen, drained ? opRecv : opPoll };
+	arm(fd, watch);
+}
+
+void PollerUring::listen(nsint fd) {
+	Watch& watch = watches[fd];
+	watch = { ++gen, opAccept };
+	listener = fd;
+	arm(fd, watch);
+}
+
+void PollerUring::arm(nsint fd, const Watch& watch) {
+	io_uring_sqe* sqe = prepare(watch.op == opRecv ? IORING_OP_RECV : watch.op == opPoll ? IORING_OP_POLL_ADD : IORING_OP_ACCEPT, fd, tag(fd, watch.gen, watch.op));
+	switch (watch.op) {
+	case opRecv:
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = recvGroup;
+		break;
+	case opPoll:
+		sqe->poll32_events = POLLIN;
+		sqe->len = IORING_POLL_ADD_MULTI;
+		break;
+	case opAccept:
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	}
+	watches.at(fd).armed = true;
+}
+
+void PollerUring::del(nsint fd) {
+	umap<nsint, Watch>::iterator it = watches.find(fd);
+	if (it == watches.end())
+		return;
+	if (it->second.armed)
+		cancel(tag(fd, it->second.gen, it->second.op));
+	if (Send* snd = it->second.send) {
+		snd->fd = INVALID_SOCKET;
+		cancel(uint64(uintptr_t(snd)));
+	}
+	if (fd == listener)
+		listener = INVALID_SOCKET;
+	watches.erase(it);
+	dropEvents(ready, fd);	// the socket number may be reused before the rest of the events are handled
+	dropEvents(pending, fd);
+}
+
+void PollerUring::dropEvents(vector<Ready>& events, nsint fd) {
+	for (Ready& it : events)
+		if (it.fd == fd) {
+			it.fd = INVALID_SOCKET;
+			it.events = 0;
+		}
+}
+
+void PollerUring::cancel(uint64 udata) {
+	prepare(IORING_OP_ASYNC_CANCEL, -1, 0)->addr = udata;
+}
+
+nsint PollerUring::accept(nsint) {
+	if (acceptFail) {
+		acceptFail = false;
+		throw Error(msgAcceptFail);
+	}
+	if (accepted.empty())
+		return INVALID_SOCKET;
+	nsint fd = accepted.front();
+	accepted.pop_front();
+	return fd;
+}
+
+void PollerUring::send(nsint fd, Outbox& out) {
+	Watch& watch = watches.at(fd);
+	if (watch.send)	// the rest goes out when it's done
+		return;
+
+	Send* snd;
+	if (freeSends.empty())
+		snd = sends.emplace_back(std::make_unique<Send>()).get();
+	else {
+		snd = freeSends.back();
+		freeSends.pop_back();
+	}
+	uint cnt = out.gather(sendBatch, [snd](uint i, const uint8* data, uint len, const sptr<uint8[]>& chunk) {
+		snd->iov[i].iov_base = const_cast<uint8*>(data);
+		snd->iov[i].iov_len = len;
+		snd->hold[i] = chunk;
+	});
+	if (!cnt) {
+		freeSends.push_back(snd);
+		return;
+	}
+	snd->msg = {};
+	snd->msg.msg_iov = snd->iov;
+	snd->msg.msg_iovlen = cnt;
+	snd->fd = fd;
+	io_uring_sqe* sqe = prepare(IORING_OP_SENDMSG, fd, uint64(uintptr_t(snd)));
+	sqe->addr = uint64(uintptr_t(&snd->msg));
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	watch.send = snd;
+	++sendCount;
+}
+
+bool PollerUring::sent(const Ready& ev, Outbox& out) {
+	out.consume(ev.len);
+	if (out.empty())
+		return true;
+	send(ev.fd, out);
+	return false;
+}
+
+void PollerUring::release(nsint fd, Buffer& recvb, Outbox& out) {
+	umap<nsint, Watch>::iterator it = watches.find(fd);
+	if (it == watches.end())
+		return;
+	if (it->second.armed)
+		cancel(tag(fd, it->second.gen, it->second.op));
+	if (it->second.send)
+		cancel(uint64(uintptr_t(it->second.send)));
+	while (it->second.armed || it->second.send) {
+		enter(1, -1);
+		reap();
+	}
+
+	for (vector<Ready>::iterator ev = pending.begin(); ev != pending.end();) {
+		if (ev->fd != fd) {
+			++ev;
+			continue;
+		}
+		if (ev->data) {
+			recvb.recvData(*ev->data, ev->len);
+			spare.push_back(uint16(ev->data - blocks.data()));
+		} else if (ev->events & EV_OUT)
+			out.consume(ev->len);
+		ev = pending.erase(ev);	// anything else, like the end of the stream, will be noticed again by the next poller
+	}
+	if (fd == listener)
+		listener = INVALID_SOCKET;
+	watches.erase(it);
+	dropEvents(ready, fd);
+}
+
+const vector<Poller::Ready>& PollerUring::wait(int timeout) {
+	for (const Ready& it : ready)	// the blocks of the last iteration have been handled
+		if (it.data)
+			provide(uint16(it.data - blocks.data()));
+	for (uint16 bid : spare)
+		provide(bid);
+	spare.clear();
+	__atomic_store_n(&bufRing->resv, bufTail, __ATOMIC_RELEASE);
+	for (nsint fd : rearm)
+		if (umap<nsint, Watch>::iterator it = watches.find(fd); it != watches.end() && !it->second.armed)
+			arm(fd, it->second);
+	rearm.clear();
+
+	ready.clear();
+	if (!pending.empty() || !accepted.empty() || acceptFail)
+		timeout = 0;
+	enter(timeout ? 1 : 0, timeout);
+	reap();
+	ready.swap(pending);
+	if (listener != INVALID_SOCKET && (!accepted.empty() || acceptFail))
+		ready.push_back({ listener, EV_IN });
+	return ready;
+}
+
+io_uring_sqe* PollerUring::prepare(uint8 opcode, nsint fd, uint64 udata) {
+	if (sqPos - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqCount) {
+		enter(0, 0);
+		if (sqPos - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqCount)
+			throw Error(msgPollFail);
+	}
+	io_uring_sqe* sqe = &sqes[sqPos++ & sqMask];
+	*sqe = {};
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = udata;
+	return sqe;
+}
+
+void PollerUring::enter(uint minComplete, int timeout) {
+	__atomic_store_n(sqTail, sqPos, __ATOMIC_RELEASE);
+	uint submit = sqPos - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+	if (!submit && !minComplete)
+		return;
+
+	uint flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+	__kernel_timespec ts{};
+	io_uring_getevents_arg arg{};
+	if (minComplete && timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		arg.ts = uint64(uintptr_t(&ts));
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+	if (syscall(__NR_io_uring_enter, ufd, submit, minComplete, flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr, sizeof(arg)) < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+		throw Error(msgPollFail);
+}
+
+void PollerUring::reap() {
+	uint head = *cqHead;
+	for (uint tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE); head != tail; ++head)
+		complete(cqes[head & cqMask]);
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+void PollerUring::complete(const io_uring_cqe& cqe) {
+	Op op = Op(cqe.user_data & 3);
+	if (op == opSend) {
+		if (cqe.user_data)	// cancellations don't need an answer
+			finishSend(reinterpret_cast<Send*>(uintptr_t(cqe.user_data)), cqe.res);
+		return;
+	}
+
+	nsint fd = nsint((cqe.user_data >> 2) & 0x3FFFFFFF);
+	umap<nsint, Watch>::iterator it = watches.find(fd);
+	bool live = it != watches.end() && it->second.gen == uint(cqe.user_data >> 32);
+	bool more = cqe.flags & IORING_CQE_F_MORE;
+	if (live && !more)
+		it->second.armed = false;
+	switch (op) {
+	case opRecv:
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			if (uint16 bid = uint16(cqe.flags >> IORING_CQE_BUFFER_SHIFT); live && cqe.res > 0)
+				pending.push_back({ fd, EV_IN, uint(cqe.res), &blocks[bid] });
+			else
+				spare.push_back(bid);
+		}
+		if (!live || cqe.res == -ECANCELED)
+			break;
+		if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS))
+			pending.push_back({ fd, EV_DISCONNECT });
+		else if (!more)	// stopped because of a full completion queue or a lack of blocks
+			rearm.push_back(fd);
+		break;
+	case opPoll:
+		if (!live || cqe.res == -ECANCELED)
+			break;
+		if (cqe.res < 0 || (cqe.res & (POLLERR | POLLHUP)))
+			pending.push_back({ fd, EV_DISCONNECT });
+		else {
+			pending.push_back({ fd, EV_IN });
+			if (!more)
+				rearm.push_back(fd);
+		}
+		break;
+	case opAccept:
+		if (cqe.res >= 0) {
+			if (live)
+				accepted.push_back(cqe.res);
+			else
+				closeSocketV(cqe.res);
+		} else if (live && cqe.res != -ECANCELED)
+			acceptFail = true;
+		if (live && !more && cqe.res != -ECANCELED)
+			rearm.push_back(fd);
+	}
+}
+
+void PollerUring::finishSend(Send* snd, int res) {
+	--sendCount;
+	if (snd->fd != INVALID_SOCKET) {
+		watches.at(snd->fd).send = nullptr;
+		if (res >= 0 || res == -ECANCELED)
+			pending.push_back({ snd->fd, EV_OUT, uint(std::max(res, 0)) });
+		else
+			pending.push_back({ snd->fd, EV_DISCONNECT });
+	}
+	for (uint i = 0; i < snd->msg.msg_iovlen; ++i)
+		snd->hold[i].reset();
+	freeSends.push_back(snd);
+}
+
+void PollerUring::provide(uint16 bid) {
+	io_uring_buf& buf = bufRing[bufTail++ & (recvBlocks - 1)];	// the first entry's last field is the ring's tail, so the fields are set separately
+	buf.addr = uint64(uintptr_t(blocks[bid].get()));
+	buf.len = Buffer::sizeStep;
+	buf.bid = bid;
+}
+#endif
@@ -0,0 +1,230 @@
+#pragma once
+
+#include "server.h"
+#include <deque>
+#ifdef EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
+
+// readiness notification for the server's sockets
+class Poller {
+public:
+	enum Event : uint8 {
+		EV_IN = 0x1,
+		EV_DISCONNECT = 0x2,
+		EV_OUT = 0x4
+	};
+
+	struct Ready {
+		nsint fd;
+		uint8 events;
+		uint len = 0;		// amount of received bytes in data or sent bytes with EV_OUT when the backend transfers data itself
+		Com::PoolPtr* data = nullptr;	// received block that may be swapped for an empty one of the same size
+	};
+
+protected:
+	vector<Ready> ready;
+
+public:
+	virtual ~Poller() = default;
+
+	static uptr<Poller> create(bool uring = false, string* failure = nullptr);	// picks the backend chosen at build time unless io_uring is requested and available (failure gets the reason why it isn't)
+	virtual void add(nsint fd, bool drained) = 0;	// drained means that the socket will be read until it would block (allows edge triggering) or that the backend may read it
+	virtual void del(nsint fd) = 0;
+	virtual void watchOut(nsint fd, bool on) = 0;	// whether to also report when a drained socket is writable
+	virtual const vector<Ready>& wait(int timeout) = 0;	// only returns sockets that have events
+	virtual const char* name() const = 0;
+
+	virtual void listen(nsint fd);	// for the listening socket, which reports EV_IN while there are connections to accept
+	virtual nsint accept(nsint fd);	// returns INVALID_SOCKET when there's nothing left
+	virtual void send(nsint fd, Com::Outbox& out);	// starts sending a drained socket's queued data
+	virtual bool sent(const Ready& ev, Com::Outbox& out);	// continues after EV_OUT and returns true once the outbox is empty
+	virtual void release(nsint fd, Com::Buffer& recvb, Com::Outbox& out);	// like del, but settles data that's in transit, so that the socket can be handed to another poller
+	virtual bool transfers() const;	// whether the backend receives and sends the data of drained sockets itself
+	virtual uint socketMemory() const;	// bytes that the backend keeps in user space per watched socket
+};
+
+inline void Poller::listen(nsint fd) {
+	add(fd, false);
+}
+
+inline nsint Poller::accept(nsint fd) {
+	return Com::acceptSocketNow(fd);
+}
+
+inline void Poller::send(nsint fd, Com::Outbox&) {
+	watchOut(fd, true);
+}
+
+inline void Poller::release(nsint fd, Com::Buffer&, Com::Outbox&) {
+	del(fd);
+}
+
+inline bool Poller::transfers() const {
+	return false;
+}
+
+inline uint Poller::socketMemory() const {
+	return 0;
+}
+
+// portable fallback that scans every socket on each wakeup
+class PollerPoll : public Poller {
+private:
+	vector<pollfd> pfds;
+	vector<uint> ids;	// index in pfds by socket or UINT_MAX
+
+public:
+	void add(nsint fd, bool drained) final;
+	void del(nsint fd) final;
+	void watchOut(nsint fd, bool on) final;
+	const vector<Ready>& wait(int timeout) final;
+	const char* name() const final;
+	uint socketMemory() const final;
+};
+
+inline const char* PollerPoll::name() const {
+	return "poll";
+}
+
+inline uint PollerPoll::socketMemory() const {
+	return sizeof(pollfd) + sizeof(uint);
+}
+
+#ifdef EPOLL
+// only reports ready sockets, so a wakeup costs as much as the amount of active players
+class PollerEpoll : public Poller {
+private:
+	int efd;
+	bool edge;
+	vector<epoll_event> events;
+
+public:
+	PollerEpoll(bool edgeTriggered);
+	~PollerEpoll() final;
+
+	void add(nsint fd, bool drained) final;
+	void del(nsint fd) final;
+	void watchOut(nsint fd, bool on) final;
+	const vector<Ready>& wait(int timeout) final;
+	const char* name() const final;
+};
+
+inline const char* PollerEpoll::name() const {
+	return edge ? "epoll (edge-triggered)" : "epoll";
+}
+#endif
+
+#ifdef IO_URING
+// submits and reaps everything through shared rings, so that an iteration needs one system call no matter how many sockets are busy
+class PollerUring : public Poller {
+private:
+	static constexpr uint sqEntries = 256;
+	static constexpr uint cqEntries = 4096;
+	static constexpr uint recvBlocks = 1024;	// provided buffers (must be a power of two)
+	static constexpr uint16 recvGroup = 0;
+	static constexpr uint sendBatch = 256;	// maximum amount of chunks per send
+
+	enum Op : uint8 {
+		opSend,	// user data is the Send record instead
+		opRecv,
+		opPoll,
+		opAccept
+	};
+
+	struct Send {
+		msghdr msg;
+		iovec iov[sendBatch];
+		sptr<uint8[]> hold[sendBatch];	// keeps the chunks alive in case the outbox is gone before the kernel is done with them
+		nsint fd;	// INVALID_SOCKET once the socket has been removed
+	};
+
+	struct Watch {
+		uint gen;
+		Op op;
+		bool armed = false;	// whether the multishot request is still running
+		Send* send = nullptr;	// the socket's send in flight
+	};
+
+	int ufd = -1;
+	void* ring = MAP_FAILED;
+	sizet ringSize = 0;
+	io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	uint* sqHead = nullptr;
+	uint* sqTail = nullptr;
+	uint sqMask = 0, sqCount = 0;
+	uint sqPos = 0;	// local tail that gets published before entering
+	uint* cqHead = nullptr;
+	uint* cqTail = nullptr;
+	uint cqMask = 0;
+	io_uring_cqe* cqes = nullptr;
+	io_uring_buf* bufRing = static_cast<io_uring_buf*>(MAP_FAILED);	// io_uring_buf_ring's flexible array is misplaced in C++, so the ring's tail is taken from the first entry's resv
+	uint16 bufTail = 0;
+	bool bufRegistered = false;
+	vector<Com::PoolPtr> blocks;	// indexed by buffer id
+	vector<uint16> spare;	// buffer ids to give back to the kernel
+	umap<nsint, Watch> watches;
+	vector<nsint> rearm;	// sockets whose multishot request ended without a reason to stop
+	vector<Ready> pending;	// events for the next wait
+	std::deque<nsint> accepted;
+	vector<uptr<Send>> sends;
+	vector<Send*> freeSends;
+	uint sendCount = 0;	// sends in flight
+	uint gen = 0;
+	nsint listener = INVALID_SOCKET;
+	bool acceptFail = false;
+
+public:
+	PollerUring();
+	~PollerUring() final;
+
+	void add(nsint fd, bool drained) final;
+	void del(nsint fd) final;
+	void watchOut(nsint fd, bool on) final;
+	const vector<Ready>& wait(int timeout) final;
+	const char* name() const final;
+
+	void listen(nsint fd) final;
+	nsint accept(nsint fd) final;
+	void send(nsint fd, Com::Outbox& out) final;
+	bool sent(const Ready& ev, Com::Outbox& out) final;
+	void release(nsint fd, Com::Buffer& recvb, Com::Outbox& out) final;
+	bool transfers() const final;
+	uint socketMemory() const final;
+
+private:
+	void closeRing();
+	io_uring_sqe* prepare(uint8 opcode, nsint fd, uint64 udata);
+	void arm(nsint fd, const Watch& watch);
+	void cancel(uint64 udata);
+	void enter(uint minComplete, int timeout);
+	void reap();
+	void complete(const io_uring_cqe& cqe);
+	void finishSend(Send* snd, int res);
+	void provide(uint16 bid);
+	void dropEvents(vector<Ready>& events, nsint fd);
+	static uint64 tag(nsint fd, uint wgen, Op op);
+};
+
+inline void PollerUring::watchOut(nsint, bool) {}
+
+inline const char* PollerUring::name() const {
+	return "io_uring";
+}
+
+inline bool PollerUring::transfers() const {
+	return true;
+}
+
+inline uint PollerUring::socketMemory() const {
+	return sizeof(pair<const nsint, Watch>) + sizeof(void*) * 2;	// hash node and bucket
+}
+
+inline uint64 PollerUring::tag(nsint fd, uint wgen, Op op) {
+	return (uint64(wgen) << 32) | (uint64(uint32(fd)) << 2) | op;
+}
+#endif
@@ -1,9 +1,52 @@
 #include "server.h"
 #include "utils/text.h"
 #include <iostream>
+#include <mutex>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UNMASK_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(__SHA__) && defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/un.h>
+#endif
+#ifdef DEFLATE
+#include <zlib.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
 
 namespace Com {
 
+#ifdef _WIN32
+using IoVec = WSABUF;
+#else
+using IoVec = iovec;
+#endif
+
+constexpr uint flushBatch = 64;	// maximum number of queued chunks to send at once
+constexpr uint chunkKeep = 16;	// sent chunks that may pile up at the front of a queue before they get erased
+#ifdef DEFLATE
+constexpr int deflateMemLevel = 4;	// the hash chains are most of a compressor's memory
+constexpr uint8 deflateTail[] = { 0x00, 0x00, 0xFF, 0xFF };	// end of a sync flush, which is left out of a message
+
+static bool deflateOffer = false;	// set once before the threads start
+static bool deflateNoContext = false;
+static uint deflateMin = UINT_MAX;
+#endif
+
 // SOCKET FUNCTIONS
 
 addrinfo* resolveAddress(const char* addr, const char* port, int family) {
@@ -36,7 +79,7 @@ nsint createSocket(int family, int reuseaddr, int nodelay) {
 	return fd;
 }
 
-nsint bindSocket(const char* port, int family) {
+nsint bindSocket(const char* port, int family, int backlog) {
 	addrinfo* inf = resolveAddress(nullptr, port, family);
 	if (!inf)
 		throw Error(msgResolveFail);
@@ -45,7 +88,7 @@ nsint bindSocket(const char* port, int family) {
 	for (addrinfo* it = inf; it; it = it->ai_next) {
 		if (fd = createSocket(it->ai_family, 1); fd == INVALID_SOCKET)
 			continue;
-		if (bind(fd, it->ai_addr, socklent(it->ai_addrlen)) || listen(fd, 8))
+		if (bind(fd, it->ai_addr, socklent(it->ai_addrlen)) || listen(fd, backlog))
 			closeSocket(fd);
 		else
 			break;
@@ -63,6 +106,27 @@ nsint acceptSocket(nsint fd) {
 	return sock;
 }
 
+nsint acceptSocketNow(nsint fd) {
+#ifdef __linux__
+	nsint sock = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	nsint sock = accept(fd, nullptr, nullptr);
+#endif
+	if (sock == INVALID_SOCKET) {
+#ifdef _WIN32
+		if (int err = WSAGetLastError(); err == WSAEWOULDBLOCK || err == WSAECONNRESET)
+#else
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR)
+#endif
+			return INVALID_SOCKET;
+		throw Error(msgAcceptFail);
+	}
+#ifndef __linux__
+	noblockSocket(sock, false);	// the socket may have inherited the listener's flag, but sends and receives only toggle it when MSG_DONTWAIT isn't available
+#endif
+	return sock;
+}
+
 int noblockSocket(nsint fd, bool noblock) {
 #ifdef _WIN32
 	u_long on = noblock;
@@ -77,11 +141,89 @@ int noblockSocket(nsint fd, bool noblock) {
 #endif
 }
 
+void keepaliveSocket(nsint fd, uint idle) {
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<char*>(&on), sizeof(on));
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+	int secs = int(std::max(idle, 1u)), intvl = std::max(secs / 3, 1), cnt = 3;	// gives up after about twice the idle time
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, reinterpret_cast<char*>(&secs), sizeof(secs));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, reinterpret_cast<char*>(&intvl), sizeof(intvl));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, reinterpret_cast<char*>(&cnt), sizeof(cnt));
+#else
+	(void)idle;
+#endif
+}
+
+uint socketRtt(nsint fd) {
+#if defined(__linux__) && defined(TCP_INFO)
+	tcp_info info;
+	if (socklen_t len = sizeof(info); !getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len))
+		return info.tcpi_rtt;
+#else
+	(void)fd;
+#endif
+	return 0;
+}
+
 static void sendNet(nsint fd, const void* data, uint size) {
-	if (send(fd, static_cast<const char*>(data), size, 0) != sendlen(size))
+	if (send(fd, static_cast<const char*>(data), size, MSG_NOSIGNAL) != sendlen(size))
+		throw Error(msgConnectionLost);
+}
+
+static void setIoVec(IoVec& iov, const void* data, uint size) {
+#ifdef _WIN32
+	iov.buf = static_cast<char*>(const_cast<void*>(data));
+	iov.len = size;
+#else
+	iov.iov_base = const_cast<void*>(data);
+	iov.iov_len = size;
+#endif
+}
+
+static long sendMsg(nsint fd, IoVec* iov, uint cnt, int flags) {
+#ifdef _WIN32
+	DWORD len;
+	return !WSASend(fd, iov, DWORD(cnt), &len, DWORD(flags), nullptr, nullptr) ? long(len) : -1;
+#else
+	msghdr msg{};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = cnt;
+	return sendmsg(fd, &msg, flags);
+#endif
+}
+
+static void sendNetv(nsint fd, IoVec* iov, uint cnt, uint size) {	// gathers all pieces into one blocking send
+	if (sendMsg(fd, iov, cnt, MSG_NOSIGNAL) != long(size))
 		throw Error(msgConnectionLost);
 }
 
+static uint sendNowv(nsint fd, IoVec* iov, uint cnt) {	// returns the amount of bytes sent without blocking
+#ifdef _WIN32
+	if (noblockSocket(fd, true))
+		throw Error(msgIoctlFail);
+	long len = sendMsg(fd, iov, cnt, 0);
+	bool wait = len < 0 && WSAGetLastError() == WSAEWOULDBLOCK;
+	if (noblockSocket(fd, false))
+		throw Error(msgIoctlFail);
+#elif !defined(MSG_DONTWAIT)
+	if (noblockSocket(fd, true))
+		throw Error(msgIoctlFail);
+	long len = sendMsg(fd, iov, cnt, MSG_NOSIGNAL);
+	bool wait = len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	if (noblockSocket(fd, false))
+		throw Error(msgIoctlFail);
+#else
+	long len = sendMsg(fd, iov, cnt, MSG_DONTWAIT | MSG_NOSIGNAL);
+	bool wait = len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#endif
+	if (len < 0) {
+		if (wait)
+			return 0;
+		throw Error(msgConnectionLost);
+	}
+	return uint(len);
+}
+
 static uint recvNet(nsint fd, void* data, uint size) {
 	long len = recv(fd, static_cast<char*>(data), size, 0);
 #ifdef EMSCRIPTEN
@@ -115,119 +257,258 @@ void closeSocket(nsint& fd) {
 	fd = INVALID_SOCKET;
 }
 
+#ifndef _WIN32
+constexpr uint handoffBatch = 253;	// the most sockets Linux takes in one message
+
+static sockaddr_un localAddress(const char* path) {
+	sockaddr_un addr{};
+	if (strlen(path) >= sizeof(addr.sun_path))
+		throw Error("Socket path too long");
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	return addr;
+}
+
+nsint bindLocal(const char* path) {
+	sockaddr_un addr = localAddress(path);
+	nsint fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == INVALID_SOCKET)
+		throw Error(msgBindFail);
+	unlink(path);
+	if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || listen(fd, 1)) {
+		close(fd);
+		throw Error(msgBindFail);
+	}
+	return fd;
+}
+
+nsint connectLocal(const char* path) {
+	sockaddr_un addr = localAddress(path);
+	nsint fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == INVALID_SOCKET)
+		throw Error(msgConnectionFail);
+	if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+		close(fd);
+		return INVALID_SOCKET;
+	}
+	return fd;
+}
+
+void timeoutSocket(nsint fd, uint secs) {
+	timeval tv = { time_t(secs), 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void sendLocal(nsint fd, const uint8* data, uint len) {
+	for (sendlen n; len; data += n, len -= uint(n))
+		if (n = send(fd, data, len, MSG_NOSIGNAL); n <= 0)
+			throw Error(msgHandoffFail);
+}
+
+static void recvLocal(nsint fd, uint8* data, uint len) {
+	for (sendlen n; len; data += n, len -= uint(n))
+		if (n = recv(fd, data, len, 0); n <= 0)
+			throw Error(msgHandoffFail);
+}
+
+void sendHandoff(nsint socket, const uint8* data, uint len, const vector<nsint>& fds) {
+	uint8 head[sizeof(uint32) * 2];
+	write32(write32(head, len), uint32(fds.size()));
+	sendLocal(socket, head, sizeof(head));
+	sendLocal(socket, data, len);
+
+	for (sizet i = 0; i < fds.size(); i += handoffBatch) {	// every batch rides on one byte, so that the receiver gets them one at a time
+		union {
+			char buf[CMSG_SPACE(sizeof(int) * handoffBatch)];
+			cmsghdr align;
+		} ctrl;
+		uint cnt = uint(std::min(fds.size() - i, sizet(handoffBatch)));
+		uint8 mark = 0;
+		iovec iov = { &mark, sizeof(mark) };
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * cnt);
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * cnt);
+		memcpy(CMSG_DATA(cmsg), fds.data() + i, sizeof(int) * cnt);	// the data isn't guaranteed to be aligned for an int
+		if (sendmsg(socket, &msg, MSG_NOSIGNAL) != sizeof(mark))
+			throw Error(msgHandoffFail);
+	}
+}
+
+vector<uint8> recvHandoff(nsint socket, vector<nsint>& fds) {
+	uint8 head[sizeof(uint32) * 2];
+	recvLocal(socket, head, sizeof(head));
+	vector<uint8> data(read32(head));
+	recvLocal(socket, data.data(), uint(data.size()));
+
+	for (uint cnt = read32(head + sizeof(uint32)); fds.size() < cnt;) {
+		union {
+			char buf[CMSG_SPACE(sizeof(int) * handoffBatch)];
+			cmsghdr align;
+		} ctrl;
+		uint8 mark;
+		iovec iov = { &mark, sizeof(mark) };
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = sizeof(ctrl.buf);
+		if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) != sizeof(mark))
+			throw Error(msgHandoffFail);
+		for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+				sizet ofs = fds.size();
+				fds.resize(ofs + (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+				memcpy(fds.data() + ofs, CMSG_DATA(cmsg), sizeof(int) * (fds.size() - ofs));
+			}
+		if (msg.msg_flags & MSG_CTRUNC)
+			throw Error(msgHandoffFail);
+	}
+	return data;
+}
+#endif
+
 // UNIVERSAL FUNCTIONS
 
-static uint32 rol(uint32 value, uint8 bits) {
-	return (value << bits) | (value >> (32 - bits));
+void unmaskData(uint8* data, uint len, const uint8* mask) {
+	uint32 key = readMem<uint32>(mask);	// every step starts at a multiple of 4 bytes, so the mask never needs to be rotated
+	uint i = 0;
+#if defined(__AVX2__)
+	for (__m256i vkey = _mm256_set1_epi32(int(key)); i + sizeof(__m256i) <= len; i += sizeof(__m256i))
+		writeMem(data + i, _mm256_xor_si256(readMem<__m256i>(data + i), vkey));
+#elif defined(UNMASK_SSE2)
+	for (__m128i vkey = _mm_set1_epi32(int(key)); i + sizeof(__m128i) <= len; i += sizeof(__m128i))
+		writeMem(data + i, _mm_xor_si128(readMem<__m128i>(data + i), vkey));
+#elif defined(__ARM_NEON)
+	for (uint8x16_t vkey = vreinterpretq_u8_u32(vdupq_n_u32(key)); i + sizeof(uint8x16_t) <= len; i += sizeof(uint8x16_t))
+		vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), vkey));
+#endif
+	for (uint64 wkey = uint64(key) | (uint64(key) << 32); i + sizeof(uint64) <= len; i += sizeof(uint64))
+		writeMem(data + i, readMem<uint64>(data + i) ^ wkey);
+	for (; i < len; ++i)
+		data[i] ^= mask[i % sizeof(uint32)];
 }
 
-static uint32 blk0(uint8* block, uint i) {
-	uint32 num = readMem<uint32>(block + i * sizeof(uint32));
-	num = (rol(num, 24) & 0xFF00FF00) | (rol(num, 8) & 0x00FF00FF);
-	writeMem(block + i * sizeof(uint32), num);
-	return num;
+#if defined(__SHA__) && defined(__SSE4_1__)
+template <int F>
+static void sha1Rounds(__m128i& abcd, __m128i* e, __m128i* msg, const uint8* block) {	// runs the 5 groups of 4 rounds that use function F
+	const __m128i order = _mm_set_epi64x(0x0001020304050607, 0x08090A0B0C0D0E0F);
+	for (uint g = F * 5; g < F * 5 + 5; ++g) {
+		__m128i& cur = e[g%2];
+		if (g < 4) {
+			msg[g] = _mm_shuffle_epi8(readMem<__m128i>(block + g * sizeof(__m128i)), order);
+			cur = g ? _mm_sha1nexte_epu32(cur, msg[g]) : _mm_add_epi32(cur, msg[g]);
+		} else
+			cur = _mm_sha1nexte_epu32(cur, msg[g%4]);
+		e[(g+1)%2] = abcd;
+		if (g >= 3 && g <= 18)
+			msg[(g+1)%4] = _mm_sha1msg2_epu32(msg[(g+1)%4], msg[g%4]);
+		abcd = _mm_sha1rnds4_epu32(abcd, cur, F);
+		if (g >= 1 && g <= 16)
+			msg[(g+3)%4] = _mm_sha1msg1_epu32(msg[(g+3)%4], msg[g%4]);
+		if (g >= 2 && g <= 17)
+			msg[(g+2)%4] = _mm_xor_si128(msg[(g+2)%4], msg[g%4]);
+	}
 }
 
-static uint32 blk(uint8* block, uint i) {
-	uint32 num = rol(readMem<uint32>(block + ((i + 13) & 15) * sizeof(uint32)) ^ readMem<uint32>(block + ((i + 8) & 15) * sizeof(uint32)) ^ readMem<uint32>(block + ((i + 2) & 15) * sizeof(uint32)) ^ readMem<uint32>(block + (i & 15) * sizeof(uint32)), 1);
-	writeMem(block + (i & 15) * sizeof(uint32), num);
-	return num;
+static void sha1Blocks(uint32* state, const uint8* data, sizet cnt) {
+	__m128i abcd = _mm_shuffle_epi32(readMem<__m128i>(state), 0x1B);
+	__m128i e[2] = { _mm_set_epi32(int(state[4]), 0, 0, 0), _mm_setzero_si128() };
+	for (; cnt; --cnt, data += 64) {
+		__m128i abcdSave = abcd, eSave = e[0], msg[4];
+		sha1Rounds<0>(abcd, e, msg, data);
+		sha1Rounds<1>(abcd, e, msg, data);
+		sha1Rounds<2>(abcd, e, msg, data);
+		sha1Rounds<3>(abcd, e, msg, data);
+		e[0] = _mm_sha1nexte_epu32(e[0], eSave);
+		abcd = _mm_add_epi32(abcd, abcdSave);
+	}
+	writeMem(state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = uint32(_mm_extract_epi32(e[0], 3));
+}
+#else
+static uint32 rol(uint32 value, uint8 bits) {
+	return (value << bits) | (value >> (32 - bits));
 }
 
-static void sha1Transform(uint32* state, uint8* buffer) {
-	array<uint32, 5> scop = { state[0], state[1], state[2], state[3], state[4] };
-	for (uint i = 0; i < 80; ++i) {
-		if (i < 16)
-			scop[4] += ((scop[1] & (scop[2] ^ scop[3])) ^ scop[3]) + blk0(buffer, i) + 0x5A827999 + rol(scop[0], 5);
-		else if (i < 20)
-			scop[4] += ((scop[1] & (scop[2] ^ scop[3])) ^ scop[3]) + blk(buffer, i) + 0x5A827999 + rol(scop[0], 5);
-		else if (i < 40)
-			scop[4] += (scop[1] ^ scop[2] ^ scop[3]) + blk(buffer, i) + 0x6ED9EBA1 + rol(scop[0], 5);
-		else if (i < 60)
-			scop[4] += (((scop[1] | scop[2]) & scop[3]) | (scop[1] & scop[2])) + blk(buffer, i) + 0x8F1BBCDC + rol(scop[0], 5);
-		else
-			scop[4] += (scop[1] ^ scop[2] ^ scop[3]) + blk(buffer, i) + 0xCA62C1D6 + rol(scop[0], 5);
-		scop[1] = rol(scop[1], 30);
-		std::rotate(scop.begin(), scop.end() - 1, scop.end());
+static void sha1Blocks(uint32* state, const uint8* data, sizet cnt) {
+	for (; cnt; --cnt, data += 64) {
+		uint32 w[80];
+		for (uint i = 0; i < 16; ++i)
+			w[i] = read32(data + i * sizeof(uint32));
+		for (uint i = 16; i < 80; ++i)
+			w[i] = rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+		uint32 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+		for (uint i = 0; i < 80; ++i) {
+			uint32 f;
+			if (i < 20)
+				f = ((b & (c ^ d)) ^ d) + 0x5A827999;
+			else if (i < 40)
+				f = (b ^ c ^ d) + 0x6ED9EBA1;
+			else if (i < 60)
+				f = (((b | c) & d) | (b & c)) + 0x8F1BBCDC;
+			else
+				f = (b ^ c ^ d) + 0xCA62C1D6;
+			f += rol(a, 5) + e + w[i];
+			e = d;
+			d = c;
+			c = rol(b, 30);
+			b = a;
+			a = f;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
 	}
-	for (uint i = 0; i < 5; ++i)
-		state[i] += scop[i];
-}
-
-static void sha1Update(uint32* state, uint32* count, uint8* buffer, uint8* data, uint32 len) {
-	uint32 j = count[0];
-	if (count[0] += len << 3; count[0] < j)
-		++count[1];
-	count[1] += len >> 29;
-	j = (j >> 3) & 63;
-
-	uint32 i;
-	if (j + len > 63) {
-		i = 64 - j;
-		std::copy_n(data, i, buffer + j);
-		sha1Transform(state, buffer);
-		for (; i + 63 < len; i += 64)
-			sha1Transform(state, data + i);
-		j = 0;
-	} else
-		i = 0;
-	std::copy_n(data + i, len - i, buffer + j);
 }
+#endif
 
 string digestSha1(string str) {
 	uint32 state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
-	uint32 count[2] = { 0, 0 };
-	uint8 buffer[64];
-	for (sizet i = 0; i < str.length(); ++i)
-		sha1Update(state, count, buffer, reinterpret_cast<uint8*>(str.data()) + i, 1);
-
-	uint8 finalcount[8];
-	for (uint i = 0; i < 8; ++i)
-		finalcount[i] = (count[i<4] >> ((3 - (i & 3)) * 8)) & 255;
-
-	uint8 c = 0x80;
-	sha1Update(state, count, buffer, &c, 1);
-	while ((count[0] & 504) != 448) {
-		c = 0;
-		sha1Update(state, count, buffer, &c, 1);
-	}
-	sha1Update(state, count, buffer, finalcount, 8);
-
-	str.resize(20);
-	for (sizet i = 0; i < str.length(); ++i)
-		str[i] = char((state[i >> 2] >> ((3 - (i & 3)) * 8)) & 255);
+	sizet full = str.length() / 64;
+	sha1Blocks(state, reinterpret_cast<const uint8*>(str.data()), full);
+
+	uint8 tail[128]{};	// the remaining data with padding and the bit count takes up one or two blocks
+	uint rest = uint(str.length() % 64);
+	std::copy_n(str.data() + full * 64, rest, tail);
+	tail[rest] = 0x80;
+	uint tlen = rest < 56 ? 64 : 128;
+	write64(tail + tlen - sizeof(uint64), uint64(str.length()) * 8);
+	sha1Blocks(state, tail, tlen / 64);
+
+	str.resize(sizeof(state));
+	for (uint i = 0; i < 5; ++i)
+		write32(str.data() + i * sizeof(uint32), state[i]);
 	return str;
 }
 
 string encodeBase64(const string& str) {
 	constexpr char b64charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-	string ret;
-	uint8 arr3[3], arr4[4];
-	uint i = 0;
-	for (char ch : str) {
-		arr3[i++] = uint8(ch);
-		if (i == 3) {
-			arr4[0] = (arr3[0] & 0xFC) >> 2;
-			arr4[1] = uint8(((arr3[0] & 0x03) << 4) + ((arr3[1] & 0xF0) >> 4));
-			arr4[2] = uint8(((arr3[1] & 0x0F) << 2) + ((arr3[2] & 0xC0) >> 6));
-			arr4[3] = arr3[2] & 0x3F;
-
-			for (i = 0; i < 4 ; ++i)
-				ret += b64charset[arr4[i]];
-			i = 0;
-		}
+	string ret((str.length() + 2) / 3 * 4, '=');
+	const uint8* src = reinterpret_cast<const uint8*>(str.data());
+	sizet i = 0, o = 0;
+	for (; i + 3 <= str.length(); i += 3, o += 4) {
+		uint32 val = (uint32(src[i]) << 16) | (uint32(src[i+1]) << 8) | src[i+2];
+		ret[o] = b64charset[val >> 18];
+		ret[o+1] = b64charset[(val >> 12) & 0x3F];
+		ret[o+2] = b64charset[(val >> 6) & 0x3F];
+		ret[o+3] = b64charset[val & 0x3F];
 	}
-	if (i) {
-		for (uint j = i; j < 3; ++j)
-			arr3[j] = '\0';
-		arr4[0] = (arr3[0] & 0xFC) >> 2;
-		arr4[1] = uint8(((arr3[0] & 0x03) << 4) + ((arr3[1] & 0xF0) >> 4));
-		arr4[2] = uint8(((arr3[1] & 0x0F) << 2) + ((arr3[2] & 0xC0) >> 6));
-
-		for (uint j = 0; j < i + 1; ++j)
-			ret += b64charset[arr4[j]];
-		while (i++ < 3)
-			ret += '=';
+	if (sizet rest = str.length() - i) {
+		uint32 val = (uint32(src[i]) << 16) | (rest > 1 ? uint32(src[i+1]) << 8 : 0);
+		ret[o] = b64charset[val >> 18];
+		ret[o+1] = b64charset[(val >> 12) & 0x3F];
+		if (rest > 1)
+			ret[o+2] = b64charset[(val >> 6) & 0x3F];
 	}
 	return ret;
 }
@@ -240,19 +521,33 @@ void sendWaitClose(nsint socket) {
 	} catch (const Error&) {}
 }
 
-void sendVersion(nsint socket, bool webs) {
+static vector<uint8> versionMessage() {
 	uint16 len = uint16(strlen(commonVersion));
 	vector<uint8> data(dataHeadSize + len);
 	data[0] = uint8(Code::version);
 	write16(data.data() + 1, uint16(data.size()));
 	std::copy_n(commonVersion, len, data.data() + dataHeadSize);
+	return data;
+}
+
+void sendVersion(nsint socket, bool webs) {
+	vector<uint8> data = versionMessage();
 	sendData(socket, data.data(), uint(data.size()), webs);
 }
 
+void sendVersion(nsint socket, Outbox& out, bool webs) {
+	vector<uint8> data = versionMessage();
+	sendData(socket, out, data.data(), uint(data.size()), webs);
+}
+
 void sendRejection(nsint server) {
-	nsint fd = INVALID_SOCKET;
 	try {
-		fd = acceptSocket(server);
+		rejectSocket(acceptSocket(server));
+	} catch (const Error&) {}
+}
+
+void rejectSocket(nsint fd) {
+	try {
 		uint8 data[dataHeadSize] = { uint8(Code::full) };
 		write16(data + 1, dataHeadSize);
 		sendNet(fd, data, dataHeadSize);
@@ -260,47 +555,516 @@ void sendRejection(nsint server) {
 	closeSocketV(fd);
 }
 
+static uint writeWsHead(uint8* frame, uint len) {
+	uint ofs = wsHeadMin;
+	frame[0] = 0x82;
+	if (len <= 125)
+		frame[1] = uint8(len);
+	else if (len <= UINT16_MAX) {
+		frame[1] = 126;
+		write16(frame + wsHeadMin, uint16(len));
+		ofs += sizeof(uint16);
+	} else {
+		frame[1] = 127;
+		write64(frame + wsHeadMin, len);
+		ofs += sizeof(uint64);
+	}
+	return ofs;
+}
+
 void sendData(nsint socket, const uint8* data, uint len, bool webs) {
 	if (webs) {
-		uint ofs = wsHeadMin;
-		uint8 frame[wsHeadMax] = { 0x82 };
-		if (len <= 125)
-			frame[1] = uint8(len);
-		else if (len <= UINT16_MAX) {
-			frame[1] = 126;
-			write16(frame + wsHeadMin, uint16(len));
-			ofs += sizeof(uint16);
-		} else {
-			frame[1] = 127;
-			write64(frame + wsHeadMin, len);
-			ofs += sizeof(uint64);
-		}
-		vector<uint8> wdat(len + ofs);
-		std::copy_n(frame, ofs, wdat.begin());
-		std::copy_n(data, len, wdat.begin() + ofs);
-		sendNet(socket, wdat.data(), uint(wdat.size()));
+		uint8 frame[wsHeadMax];
+		uint ofs = writeWsHead(frame, len);
+		IoVec iov[2];
+		setIoVec(iov[0], frame, ofs);
+		setIoVec(iov[1], data, len);
+		sendNetv(socket, iov, 2, ofs + len);
 	} else
 		sendNet(socket, data, len);
 }
 
+void sendData(nsint socket, Outbox& out, const uint8* data, uint len, bool webs) {
+	if (webs) {
+#ifdef DEFLATE
+		if (out.writeDeflated(socket, data, len))
+			return;
+#endif
+		uint8 frame[wsHeadMax];
+		out.write(socket, frame, writeWsHead(frame, len), data, len);
+	} else
+		out.write(socket, data, len);
+}
+
+// FRAME
+
+Frame::Frame(const uint8* msg, uint len) :
+	data(new uint8[headSpace + len]),
+	size(headSpace + len)
+{
+	uint8 head[wsHeadMax];
+	uint hlen = writeWsHead(head, len);
+	wofs = headSpace - hlen;
+	std::copy_n(head, hlen, &data[wofs]);
+	std::copy_n(msg, len, &data[headSpace]);
+}
+
+void Frame::send(nsint socket, bool webs) const {
+	sendNet(socket, getData(webs), getSize(webs));
+}
+
+#ifdef DEFLATE
+// DEFLATE
+
+struct DeflateShared {
+	uptr<z_stream, DeflateEnd> def;	// for connections without context takeover
+	uptr<z_stream, InflateEnd> inf;
+	vector<uint8> out;	// last compressed frame or decompressed message
+};
+
+static DeflateShared& deflateShared() {
+	static thread_local DeflateShared ds;
+	return ds;
+}
+
+static uptr<z_stream, DeflateEnd> newDeflater() {
+	uptr<z_stream, DeflateEnd> zs(new z_stream());
+	if (deflateInit2(zs.get(), Z_DEFAULT_COMPRESSION, Z_DEFLATED, -Deflate::windowBits, deflateMemLevel, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw Error(msgZlibFail);
+	return zs;
+}
+
+static uptr<z_stream, InflateEnd> newInflater(uint8 bits) {
+	uptr<z_stream, InflateEnd> zs(new z_stream());
+	if (inflateInit2(zs.get(), -int(bits)) != Z_OK)
+		throw Error(msgZlibFail);
+	return zs;
+}
+
+static std::string_view trimView(std::string_view str) {
+	sizet beg = str.find_first_not_of(" \t");
+	return beg != std::string_view::npos ? str.substr(beg, str.find_last_not_of(" \t") - beg + 1) : std::string_view();
+}
+
+static uint8 windowParam(std::string_view val) {	// returns 0 if it isn't valid
+	val = trimView(val);
+	if (val.length() >= 2 && val.front() == '"' && val.back() == '"')
+		val = val.substr(1, val.length() - 2);
+	if (val.length() == 1 && val[0] >= '8' && val[0] <= '9')
+		return uint8(val[0] - '0');
+	if (val.length() == 2 && val[0] == '1' && val[1] >= '0' && val[1] <= '5')
+		return uint8(10 + val[1] - '0');
+	return 0;
+}
+
+void DeflateEnd::operator()(z_stream_s* zs) const {
+	deflateEnd(zs);
+	delete zs;
+}
+
+void InflateEnd::operator()(z_stream_s* zs) const {
+	inflateEnd(zs);
+	delete zs;
+}
+
+Deflate::Deflate(const Mode& how) :
+	mode(how)
+{}
+
+void Deflate::configure(uint minSize, bool noContext) {
+	deflateOffer = true;
+	deflateNoContext = noContext;
+	deflateMin = minSize;
+}
+
+uptr<Deflate> Deflate::negotiate(std::string_view offers, string& response) {
+	for (sizet next = 0; deflateOffer && next != std::string_view::npos; offers.remove_prefix(std::min(next + 1, offers.length()))) {
+		next = offers.find(',');
+		std::string_view ext = offers.substr(0, next);
+		Mode how;
+		how.serverReset = how.clientReset = deflateNoContext;
+		bool ok = true, serverMax = false, clientMax = false;
+		for (sizet end = 0, i = 0; ok && end != std::string_view::npos; ext.remove_prefix(std::min(end + 1, ext.length())), ++i) {
+			end = ext.find(';');
+			std::string_view param = ext.substr(0, end);
+			sizet eq = param.find('=');
+			std::string_view key = trimView(param.substr(0, eq));
+			if (!i)
+				ok = key == "permessage-deflate";
+			else if (key == "server_no_context_takeover")
+				how.serverReset = true;
+			else if (key == "client_no_context_takeover")
+				how.clientReset = true;
+			else if (key == "server_max_window_bits") {	// the server's compressor can't use a smaller window
+				uint8 bits = eq != std::string_view::npos ? windowParam(param.substr(eq + 1)) : 0;
+				ok = bits >= windowBits;
+				serverMax = true;
+			} else if (key == "client_max_window_bits") {	// the client lets the server pick a window that's at most as big as the given one
+				uint8 bits = eq != std::string_view::npos ? windowParam(param.substr(eq + 1)) : maxWindowBits;
+				ok = bits;
+				how.clientBits = std::min(bits, windowBits);
+				clientMax = true;
+			} else
+				ok = false;
+		}
+		if (!ok)
+			continue;
+
+		response += "Sec-WebSocket-Extensions: permessage-deflate";
+		if (how.serverReset)
+			response += "; server_no_context_takeover";
+		if (how.clientReset)
+			response += "; client_no_context_takeover";
+		if (serverMax)
+			response += "; server_max_window_bits=" + toStr(windowBits);
+		if (clientMax)
+			response += "; client_max_window_bits=" + toStr(how.clientBits);
+		response += "\r\n";
+		return std::make_unique<Deflate>(how);
+	}
+	return nullptr;
+}
+
+bool Deflate::wants(uint len) const {
+	return len >= deflateMin;
+}
+
+const uint8* Deflate::compress(const uint8* msg, uint len, uint& flen) {
+	constexpr uint headSpace = wsHeadMax - sizeof(uint32);
+	DeflateShared& ds = deflateShared();
+	uptr<z_stream, DeflateEnd>& zs = mode.serverReset ? ds.def : def;
+	if (!zs)
+		zs = newDeflater();
+	if (ds.out.size() < headSpace + len / 2 + poolBlockMin)
+		ds.out.resize(headSpace + len / 2 + poolBlockMin);
+
+	zs->next_in = const_cast<uint8*>(msg);
+	zs->avail_in = len;
+	uint end = headSpace;
+	do {	// a sync flush is only complete when there's output space left
+		if (end == ds.out.size())
+			ds.out.resize(ds.out.size() * 2);
+		zs->next_out = &ds.out[end];
+		zs->avail_out = uint(ds.out.size()) - end;
+		if (int rc = deflate(zs.get(), Z_SYNC_FLUSH); rc != Z_OK && rc != Z_BUF_ERROR)
+			throw Error(msgZlibFail);
+		end = uint(ds.out.size()) - zs->avail_out;
+	} while (!zs->avail_out);
+	end -= sizeof(deflateTail);
+	if (mode.serverReset) {
+		deflateReset(zs.get());
+		if (end - headSpace >= len)	// nothing refers back to it, so it can be sent as it is
+			return nullptr;
+	}
+
+	uint8 head[wsHeadMax];
+	uint hlen = writeWsHead(head, end - headSpace);
+	head[0] |= 0x40;	// RSV1 marks a compressed message
+	std::copy_n(head, hlen, &ds.out[headSpace-hlen]);
+	flen = end - headSpace + hlen;
+	return &ds.out[headSpace-hlen];
+}
+
+const uint8* Deflate::decompress(const uint8* load, uint len, uint& mlen) {
+	constexpr uint cap = dataSizeLimit + 1;	// one more than a message can have to notice when it's too big
+	DeflateShared& ds = deflateShared();
+	uptr<z_stream, InflateEnd>& zs = mode.clientReset ? ds.inf : inf;
+	if (!zs)
+		zs = newInflater(mode.clientReset ? maxWindowBits : mode.clientBits);
+	if (ds.out.size() < cap)
+		ds.out.resize(cap);
+
+	zs->next_out = ds.out.data();
+	zs->avail_out = cap;
+	for (auto [src, slen] : { pair(load, len), pair(deflateTail, uint(sizeof(deflateTail))) }) {
+		zs->next_in = const_cast<uint8*>(src);
+		zs->avail_in = slen;
+		for (int rc; (rc = inflate(zs.get(), Z_SYNC_FLUSH)) != Z_OK && rc != Z_BUF_ERROR;) {
+			if (rc != Z_STREAM_END)
+				throw Error(msgProtocolError);
+			inflateReset(zs.get());	// a final block only ends the client's stream, not the connection
+			if (!zs->avail_in)
+				break;
+		}
+		if (zs->avail_in)
+			throw Error(msgProtocolError);
+	}
+	if (mlen = cap - zs->avail_out; mlen > dataSizeLimit)
+		throw Error(msgProtocolError);
+	if (mode.clientReset)
+		inflateReset(zs.get());
+	return ds.out.data();
+}
+
+string Deflate::getWindow() const {
+	if (!inf)
+		return string();
+	string win(1u << maxWindowBits, '\0');
+	uInt len = 0;
+	inflateGetDictionary(inf.get(), reinterpret_cast<Bytef*>(win.data()), &len);
+	win.resize(len);
+	return win;
+}
+
+void Deflate::setWindow(const uint8* data, uint len) {
+	if (!len || mode.clientReset)
+		return;
+	if (!inf)
+		inf = newInflater(mode.clientBits);
+	if (inflateSetDictionary(inf.get(), data, len) != Z_OK)
+		throw Error(msgZlibFail);
+}
+#endif
+
+// POOL
+
+struct PoolClass {
+	vector<uint8*> free;
+	uint slabs = 0;
+	uint blocks = 0;
+	uint used = 0;
+};
+
+struct PoolState {
+	std::mutex mtx;
+	array<PoolClass, 9> classes;	// from poolBlockMin to poolBlockMax
+	uint large = 0;
+};
+
+static PoolState& poolState() {
+	static PoolState* state = new PoolState;	// never destroyed, since buffers of static objects may be freed after it
+	return *state;
+}
+
+static uint poolClass(uint size) {
+	uint id = 0;
+	for (uint bsize = poolBlockMin; bsize < size; bsize <<= 1, ++id);
+	return id;
+}
+
+PoolPtr poolAlloc(uint size) {
+	PoolState& ps = poolState();
+	if (size > poolBlockMax) {
+		std::lock_guard lock(ps.mtx);
+		++ps.large;
+		return PoolPtr(new uint8[size], PoolDeleter{ size });
+	}
+
+	uint id = poolClass(size);
+	uint bsize = poolBlockMin << id;
+	std::lock_guard lock(ps.mtx);
+	PoolClass& pc = ps.classes[id];
+	if (pc.free.empty()) {
+		uint cnt = std::max(poolSlabSize / bsize, 1u);
+		uint8* slab = new uint8[cnt * bsize];
+		for (uint i = cnt; i--;)
+			pc.free.push_back(slab + i * bsize);
+		++pc.slabs;
+		pc.blocks += cnt;
+	}
+	uint8* ptr = pc.free.back();
+	pc.free.pop_back();
+	++pc.used;
+	return PoolPtr(ptr, PoolDeleter{ bsize });
+}
+
+void PoolDeleter::operator()(uint8* ptr) const {
+	PoolState& ps = poolState();
+	std::lock_guard lock(ps.mtx);
+	if (size > poolBlockMax) {
+		delete[] ptr;
+		--ps.large;
+	} else {
+		PoolClass& pc = ps.classes[poolClass(size)];
+		pc.free.push_back(ptr);
+		--pc.used;
+	}
+}
+
+uint poolRound(uint size) {
+	return size <= poolBlockMax ? poolBlockMin << poolClass(size) : size;
+}
+
+vector<PoolStats> poolStats() {
+	PoolState& ps = poolState();
+	std::lock_guard lock(ps.mtx);
+	vector<PoolStats> stats(ps.classes.size() + 1);
+	for (uint i = 0; i < ps.classes.size(); ++i)
+		stats[i] = { poolBlockMin << i, ps.classes[i].slabs, ps.classes[i].blocks, ps.classes[i].used };
+	stats.back() = { 0, 0, ps.large, ps.large };
+	return stats;
+}
+
+// OUTBOX
+
+void Outbox::write(nsint socket, const uint8* data, uint len) {
+	write(socket, nullptr, 0, data, len);
+}
+
+void Outbox::write(nsint socket, const uint8* head, uint hlen, const uint8* data, uint len) {
+	uint sent = 0;
+	if (chunks.empty() && !deferred) {
+		IoVec iov[2];
+		setIoVec(iov[0], head, hlen);
+		setIoVec(iov[1], data, len);
+		sent = sendNowv(socket, iov, 2);
+	}
+	if (uint total = hlen + len; sent < total) {
+		Chunk chunk = { sptr<uint8[]>(new uint8[total - sent]), 0, total - sent };
+		if (sent < hlen) {
+			std::copy_n(head + sent, hlen - sent, chunk.data.get());
+			std::copy_n(data, len, &chunk.data[hlen-sent]);
+		} else
+			std::copy_n(data + (sent - hlen), chunk.end, chunk.data.get());
+		push(socket, std::move(chunk));
+	}
+}
+
+void Outbox::write(nsint socket, const Frame& frame, bool webs) {
+#ifdef DEFLATE
+	if (webs && writeDeflated(socket, frame.getData(false), frame.getSize(false)))
+		return;
+#endif
+	uint pos = uint(frame.getData(webs) - frame.data.get());
+	if (chunks.empty() && !deferred) {
+		IoVec iov;
+		setIoVec(iov, frame.getData(webs), frame.getSize(webs));
+		pos += sendNowv(socket, &iov, 1);
+	}
+	if (pos < frame.size)
+		push(socket, Chunk{ frame.data, pos, frame.size });
+}
+
+void Outbox::write(nsint socket, const vector<Frame>& frames, bool webs) {
+#ifdef DEFLATE
+	if (webs && zip && std::any_of(frames.begin(), frames.end(), [this](const Frame& it) -> bool { return zip->wants(it.getSize(false)); })) {
+		vector<uint8> pack;	// compressed frames differ between connections, so everything gets copied into one send
+		for (const Frame& it : frames) {
+			const uint8* frame = nullptr;
+			uint flen;
+			if (zip->wants(it.getSize(false)))
+				frame = zip->compress(it.getData(false), it.getSize(false), flen);
+			if (!frame) {
+				frame = it.getData(true);
+				flen = it.getSize(true);
+			}
+			pack.insert(pack.end(), frame, frame + flen);
+		}
+		write(socket, pack.data(), uint(pack.size()));
+		return;
+	}
+#endif
+	uint sent = 0;
+	if (chunks.empty() && !deferred && !frames.empty()) {
+		IoVec iov[flushBatch];
+		uint cnt = uint(std::min(frames.size(), sizet(flushBatch)));
+		for (uint i = 0; i < cnt; ++i)
+			setIoVec(iov[i], frames[i].getData(webs), frames[i].getSize(webs));
+		sent = sendNowv(socket, iov, cnt);
+	}
+	for (const Frame& it : frames) {
+		if (uint len = it.getSize(webs); sent >= len) {
+			sent -= len;
+			continue;
+		}
+		push(socket, Chunk{ it.data, uint(it.getData(webs) - it.data.get()) + sent, it.size });
+		sent = 0;
+	}
+}
+
+#ifdef DEFLATE
+bool Outbox::writeDeflated(nsint socket, const uint8* msg, uint len) {
+	if (!zip || !zip->wants(len))
+		return false;
+	uint flen;
+	const uint8* frame = zip->compress(msg, len, flen);
+	if (!frame)
+		return false;
+	write(socket, frame, flen);
+	return true;
+}
+#endif
+
+void Outbox::push(nsint socket, Chunk&& chunk) {
+	uint len = chunk.end - chunk.pos;
+	if (size + len > limit)
+		throw Error(msgSendOverflow);
+	if (chunks.empty() && backlog)
+		backlog->push_back(socket);
+	chunks.push_back(std::move(chunk));
+	size += len;
+}
+
+bool Outbox::flush(nsint socket) {
+	while (!chunks.empty()) {
+		IoVec iov[flushBatch];
+		uint cnt = 0, total = 0;
+		for (vector<Chunk>::iterator it = chunks.begin() + front; it != chunks.end() && cnt < flushBatch; ++it, ++cnt) {
+			setIoVec(iov[cnt], &it->data[it->pos], it->end - it->pos);
+			total += it->end - it->pos;
+		}
+
+		uint sent = sendNowv(socket, iov, cnt);
+		consume(sent);
+		if (sent < total)
+			return false;
+	}
+	return true;
+}
+
+void Outbox::consume(uint len) {
+	size -= len;
+	while (len) {
+		Chunk& it = chunks[front];
+		if (uint left = it.end - it.pos; len < left) {
+			it.pos += len;
+			break;
+		} else {
+			len -= left;
+			it.data.reset();
+			++front;
+		}
+	}
+
+	if (front == chunks.size()) {
+		if (chunks.capacity() > chunkKeep)
+			chunks = vector<Chunk>();	// don't let a burst hold on to its memory
+		else
+			chunks.clear();
+		front = 0;
+	} else if (front >= chunkKeep && front * 2 >= chunks.size()) {
+		chunks.erase(chunks.begin(), chunks.begin() + front);
+		front = 0;
+	}
+}
+
 // BUFFER
 
-uint Buffer::pushHead(Code code, uint16 dlen) {
-	uint end = checkOver(dlim + dataHeadSize);
-	data[dlim] = uint8(code);
-	write16(&data[dlim+1], dlen);
+uint Buffer::pushHead(Code code, uint dlen) {
+	uint end = checkOver(dlim + (dlen > UINT16_MAX ? wideHeadSize : dataHeadSize));
+	writeHead(code, dlen);
 	return dlim = end;
 }
 
-uint Buffer::allocate(Code code, uint16 dlen) {
-	uint end = checkOver(dlim + dlen);
-	data[dlim] = uint8(code);
-	write16(&data[dlim+1], dlen);
-	uint ret = dlim + dataHeadSize;
+uint Buffer::allocate(Code code, uint dlen) {
+	uint hsize = dlen > UINT16_MAX ? wideHeadSize : dataHeadSize;
+	uint end = checkOver(dlim + dlen + hsize - dataHeadSize);
+	writeHead(code, dlen);
+	uint ret = dlim + hsize;
 	dlim = end;
 	return ret;
 }
 
+void Buffer::writeHead(Code code, uint dlen) {	// dlen is the size with a regular head, which a wide head extends by the 32 bit size
+	data[dlim] = uint8(code);
+	if (dlen <= UINT16_MAX)
+		write16(&data[dlim+1], uint16(dlen));
+	else {
+		write16(&data[dlim+1], 0);
+		write32(&data[dlim+dataHeadSize], dlen + sizeof(uint32));
+	}
+}
+
 void Buffer::push(uint8 val) {
 	pushNumber(val, [](uint8* d, uint8 v) { *d = v; });
 }
@@ -340,7 +1104,7 @@ void Buffer::push(initlist<uint8> lst) {
 	pushRaw(lst);
 }
 
-void Buffer::push(const string& str) {
+void Buffer::push(std::string_view str) {
 	pushRaw(str);
 }
 
@@ -382,18 +1146,22 @@ uint Buffer::writeNumber(T val, uint pos, F writer) {
 	return pos + sizeof(val);
 }
 
-void Buffer::redirect(nsint socket, uint8* pos, bool sendWebs) {
-	if (pos == data.get())	// no offset means no ws frame
-		sendData(socket, data.get(), readLoadSize(false), sendWebs);	// send like normal
+void Buffer::redirect(nsint socket, Outbox& out, uint8* pos, bool sendWebs) {
+	if (pos == &data[rpos])	// no offset means no ws frame
+		sendData(socket, out, pos, readLoadSize(false), sendWebs);	// send like normal
 	else if (sendWebs) {
-		if (data[1] & 0x80) {
-			data[1] &= 0x7F;
-			std::copy(pos, &data[dlim], pos - sizeof(uint32));	// should already be unmasked
-			dlim -= sizeof(uint32);	// skip resize because there should be an erase right after this anyway
+#ifdef DEFLATE
+		if (out.writeDeflated(socket, pos, readSize(pos)))
+			return;
+#endif
+		if (data[rpos+1] & 0x80) {
+			data[rpos+1] &= 0x7F;
+			std::copy_backward(&data[rpos], pos - sizeof(uint32), pos);	// move the header over the mask, the payload should already be unmasked
+			rpos += sizeof(uint32);
 		}
-		sendNet(socket, data.get(), readLoadSize(true));	// reuse ws frame without mask
+		out.write(socket, &data[rpos], readLoadSize(true));	// reuse ws frame without mask
 	} else
-		sendNet(socket, pos, read16(pos + 1));	// skip ws frame
+		out.write(socket, pos, readSize(pos));	// skip ws frame
 }
 
 void Buffer::send(nsint socket, bool webs, bool clr) {
@@ -401,10 +1169,22 @@ void Buffer::send(nsint socket, bool webs, bool clr) {
 		clear();
 }
 
-uint8* Buffer::recv(nsint socket, bool webs) {
+void Buffer::send(nsint socket, Outbox& out, bool webs, bool clr) {
+	if (sendData(socket, out, data.get(), dlim, webs); clr)
+		clear();
+}
+
+uint8* Buffer::recv(nsint socket, bool webs, Outbox* out) {
 	uint ofs = 0;
 	uint8* mask = nullptr;
-	return recvHead(socket, ofs, mask, webs) ? recvLoad(ofs, mask) : nullptr;
+	return recvHead(socket, ofs, mask, webs, out) ? recvLoad(ofs, mask) : nullptr;
+}
+
+uint8* Buffer::recvRun(uint& len, Code first, Code last) {
+	uint pos = rpos;
+	for (uint mlen; dlim - pos >= dataHeadSize && Code(data[pos]) >= first && Code(data[pos]) <= last && (mlen = read16(&data[pos+1])) >= dataHeadSize && dlim - pos >= mlen; pos += mlen);
+	len = pos - rpos;
+	return len ? &data[rpos] : nullptr;
 }
 
 bool Buffer::recvData(nsint socket) {
@@ -424,19 +1204,37 @@ bool Buffer::recvData(nsint socket) {
 	}
 }
 
-Buffer::Init Buffer::recvConn(nsint socket, bool& webs) {
+void Buffer::recvData(PoolPtr& block, uint len) {
+	if (rpos == dlim && size == sizeStep) {
+		data.swap(block);
+		rpos = 0;
+		dlim = len;
+	} else
+		recvData(block.get(), len);
+}
+
+void Buffer::recvData(const uint8* src, uint len) {
+	checkOver(dlim + len);
+	std::copy_n(src, len, &data[dlim]);
+	dlim += len;
+}
+
+Buffer::Init Buffer::recvConn(nsint socket, bool& webs, Outbox* out, uint* vid) {
 	uint ofs = 0;
 	uint8* mask = nullptr;
-	if (!recvHead(socket, ofs, mask, webs))
+	if (!recvHead(socket, ofs, mask, webs, out))
 		return Init::wait;
 
-	switch (uint8 dc = mask ? data[ofs] ^ mask[0] : data[ofs]; Code(dc)) {
+	switch (uint8 dc = mask ? data[rpos+ofs] ^ mask[0] : data[rpos+ofs]; Code(dc)) {
 	case Code::version: {
 		uint8* dat = recvLoad(ofs, mask);
 		if (!dat)
 			return Init::wait;
-		if (std::find(compatibleVersions.begin(), compatibleVersions.end(), readText(dat)) == compatibleVersions.end())
+		array<const char*, compatibleVersions.size()>::const_iterator ver = std::find(compatibleVersions.begin(), compatibleVersions.end(), readText(dat));
+		if (ver == compatibleVersions.end())
 			return Init::version;
+		if (vid)
+			*vid = uint(ver - compatibleVersions.begin());
 		clearCur(webs);
 		return Init::connect; }
 	case Code::wsconn: {
@@ -444,13 +1242,14 @@ Buffer::Init Buffer::recvConn(nsint socket, bool& webs) {
 			break;
 
 		string word = "\r\n\r\n";
-		uint8* rend = std::search(data.get(), &data[dlim], word.begin(), word.end());
+		uint8* rbeg = &data[rpos];
+		uint8* rend = std::search(rbeg, &data[dlim], word.begin(), word.end());
 		if (rend == &data[dlim])
 			return Init::wait;
 
 		rend += pdift(word.length());
 		word = "Sec-WebSocket-Key:";
-		uint8* pos = std::search(data.get(), rend, word.begin(), word.end());
+		uint8* pos = std::search(rbeg, rend, word.begin(), word.end());
 		if (pos == rend)
 			break;
 
@@ -460,9 +1259,27 @@ Buffer::Init Buffer::recvConn(nsint socket, bool& webs) {
 		string response = "HTTP/1.1 101 Switching Protocols\r\n"
 			"Upgrade: websocket\r\n"
 			"Connection: Upgrade\r\n"
-			"Sec-WebSocket-Accept: " + encodeBase64(digestSha1(trim(key) + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11")) + "\r\n\r\n";
-		sendNet(socket, response.c_str(), uint(response.length()));
-		eraseFront(uint(rend - data.get()));
+			"Sec-WebSocket-Accept: " + encodeBase64(digestSha1(trim(key) + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11")) + "\r\n";
+#ifdef DEFLATE
+		if (out) {	// the compression state is kept with the connection's outbox
+			string offers, crlf = "\r\n";
+			word = "Sec-WebSocket-Extensions:";
+			for (uint8* ext = rbeg; (ext = std::search(ext, rend, word.begin(), word.end())) != rend;) {
+				ext += pdift(word.length());
+				uint8* eol = std::search(ext, rend, crlf.begin(), crlf.end());
+				offers += (offers.empty() ? "" : ",") + string(ext, eol);
+				ext = eol;
+			}
+			if (uptr<Deflate> zip = Deflate::negotiate(offers, response))
+				out->setDeflate(std::move(zip));
+		}
+#endif
+		response += "\r\n";
+		if (out)
+			out->write(socket, reinterpret_cast<const uint8*>(response.c_str()), uint(response.length()));
+		else
+			sendNet(socket, response.c_str(), uint(response.length()));
+		eraseFront(uint(rend - rbeg));
 		webs = true;
 		return Init::cont; }
 	default:
@@ -472,111 +1289,260 @@ Buffer::Init Buffer::recvConn(nsint socket, bool& webs) {
 	return Init::error;
 }
 
-bool Buffer::recvHead(nsint socket, uint& ofs, uint8*& mask, bool webs) {
-	if (webs) {
-		if (ofs += wsHeadMin; dlim < ofs)
+bool Buffer::recvHead(nsint socket, uint& ofs, uint8*& mask, bool webs, Outbox* out) {
+	if (!webs)
+		return dlim - rpos >= ofs + dataHeadSize;
+#ifdef DEFLATE
+	Deflate* zip = out ? out->getDeflate() : nullptr;
+#else
+	constexpr void* zip = nullptr;
+#endif
+
+	for (;;) {	// control frames are handled right away, so that the data behind them doesn't have to wait for the next receive
+		uint pos = rpos + fragNext;	// frames of a fragmented message get joined at the front, so the next one to parse is behind them
+		uint dlen = dlim - pos;
+		uint8* rdat = &data[pos];
+		ofs = wsHeadMin;
+		mask = nullptr;
+		if (dlen < ofs)
 			return false;
-		if ((data[0] & 0xF0) != 0x80)	// TODO: handle fragmentation
+		if ((rdat[0] & 0x30) || ((rdat[0] & 0x40) && (!zip || (rdat[0] & 0xF) != 2)))	// RSV1 marks the first frame of a compressed message
 			throw Error(msgProtocolError);
 
-		uint plen = data[1] & 0x7F;
+		uint plen = rdat[1] & 0x7F;
 		if (plen == 126) {
-			if (ofs += sizeof(uint16); dlim < ofs)
+			if (ofs += sizeof(uint16); dlen < ofs)
 				return false;
-			plen = read16(&data[wsHeadMin]);
+			plen = read16(rdat + wsHeadMin);
 		} else if (plen == 127) {
-			if (ofs += sizeof(uint64); dlim < ofs)
+			if (ofs += sizeof(uint64); dlen < ofs)
 				return false;
-			plen = uint(read64(&data[wsHeadMin]));
+			plen = uint(std::min(read64(rdat + wsHeadMin), uint64(UINT32_MAX)));
 		}
 
-		if (data[1] & 0x80) {
-			if (ofs += sizeof(uint32); dlim < ofs)
+		if (rdat[1] & 0x80) {
+			if (ofs += sizeof(uint32); dlen < ofs)
 				return false;
-			mask = &data[ofs-sizeof(uint32)];
+			mask = rdat + ofs - sizeof(uint32);
 		}
 
-		if (uint8 opc = data[0] & 0xF; opc != 2) {
-			switch (opc) {
-			case 8:
-				resendWs(socket, ofs, plen, mask);
-				throw Error("Connection closed");
-			case 9:
-				data[0] = 0x8A;
-				resendWs(socket, ofs, plen, mask);
-				break;
-			default:
+		bool fin = rdat[0] & 0x80;
+		switch (rdat[0] & 0xF) {
+		case 0:	// continuation
+			if (!fragNext || plen > dataSizeLimit - (fragEnd - fragBegin))
 				throw Error(msgProtocolError);
+			if (dlen < ofs + plen)
+				return false;
+			if (mask)
+				unmask(mask, pos + ofs, pos + ofs + plen);
+			std::copy_n(&data[pos+ofs], plen, &data[rpos+fragEnd]);	// unmasked in place and moved once to the end of the joined payload
+			fragEnd += plen;
+			skipFrame(ofs + plen);
+			if (fin)
+				joinFragments(true);
+			break;
+		case 2:
+			if (fragNext)	// a new message can't start before the fragmented one is finished
+				throw Error(msgProtocolError);
+#ifdef DEFLATE
+			if (fin && (rdat[0] & 0x40)) {
+				if (plen > dataSizeLimit)
+					throw Error(msgProtocolError);
+				if (dlen < ofs + plen)
+					return false;
+				inflateFrame(ofs, plen, mask, *zip);
+				break;
 			}
+#endif
+			if (fin)
+				return dlen >= ofs + dataHeadSize;
+			if (!mask || plen > dataSizeLimit)	// the mask leaves room for the header of the joined message
+				throw Error(msgProtocolError);
+			if (dlen < ofs + plen)
+				return false;
+			unmask(mask, pos + ofs, pos + ofs + plen);
+			fragBegin = ofs;
+			fragEnd = fragNext = ofs + plen;
+			break;
+		case 8:
+			if (!fin)
+				throw Error(msgProtocolError);
+			if (resendWs(socket, pos, ofs, plen, mask, out, 0x88))
+				throw Error("Connection closed");
 			return false;
+		case 9:
+			if (!fin)
+				throw Error(msgProtocolError);
+			if (!resendWs(socket, pos, ofs, plen, mask, out, 0x8A))
+				return false;
+			skipFrame(ofs + plen);
+			break;
+		case 10:
+			if (!fin || plen > 125)
+				throw Error(msgProtocolError);
+			if (dlen < ofs + plen)
+				return false;
+			skipFrame(ofs + plen);
+			pong = true;
+			break;
+		default:
+			throw Error(msgProtocolError);
 		}
 	}
-	return dlim >= ofs + dataHeadSize;
 }
 
+#ifdef DEFLATE
+void Buffer::inflateFrame(uint hsize, uint plen, const uint8* mask, Deflate& zip) {	// replaces the compressed frame at the front with a plain one
+	if (mask)
+		unmask(mask, rpos + hsize, rpos + hsize + plen);
+	uint mlen;
+	const uint8* msg = zip.decompress(&data[rpos+hsize], plen, mlen);
+	if (mlen < dataHeadSize || (!read16(msg + 1) && mlen < wideHeadSize) || readSize(msg) != mlen)	// a WebSocket message carries exactly one message
+		throw Error(msgProtocolError);
+
+	uint8 head[wsHeadMax];
+	uint nlen = writeWsHead(head, mlen);
+	uint oend = hsize + plen, nend = nlen + mlen;
+	if (nend > oend) {
+		checkOver(dlim + nend - oend);
+		std::copy_backward(&data[rpos+oend], &data[dlim], &data[dlim+nend-oend]);
+	} else
+		std::copy(&data[rpos+oend], &data[dlim], &data[rpos+nend]);
+	dlim = dlim + nend - oend;
+	std::copy_n(head, nlen, &data[rpos]);
+	std::copy_n(msg, mlen, &data[rpos+nlen]);
+}
+#endif
+
 uint8* Buffer::recvLoad(uint ofs, const uint8* mask) {
-	if (mask) {
-		uint8 buf[sizeof(uint16)] = { uint8(data[ofs+1] ^ mask[1]), uint8(data[ofs+2] ^ mask[2]) };
-		uint end = read16(buf) + ofs;
-		if (dlim < end)
+	uint8* rdat = &data[rpos];
+	uint8 head[wideHeadSize]{};
+	uint hlen = std::min(dlim - rpos - ofs, uint(wideHeadSize));	// at least the regular head has arrived
+	std::copy_n(rdat + ofs, hlen, head);
+	if (mask)
+		for (uint i = 0; i < hlen; ++i)
+			head[i] ^= mask[i % sizeof(uint32)];
+
+	uint end = read16(head + 1);
+	if (!end) {	// wide head
+		if (hlen < wideHeadSize)
 			return nullptr;
-		unmask(mask, ofs, end);
-	} else if (dlim < read16(&data[ofs+1]))
+		if (end = read32(head + dataHeadSize); end < wideHeadSize || end > dataSizeLimit)
+			throw Error(msgProtocolError);
+	}
+	if (end += ofs; dlim - rpos < end)
 		return nullptr;
-	return &data[ofs];
+	if (mask)
+		unmask(mask, rpos + ofs, rpos + end);
+	return rdat + ofs;
 }
 
-void Buffer::resendWs(nsint socket, uint hsize, uint plen, const uint8* mask) {
+bool Buffer::resendWs(nsint socket, uint pos, uint hsize, uint plen, const uint8* mask, Outbox* out, uint8 head) {
+	if (plen > 125)	// control frames can't be bigger
+		throw Error(msgProtocolError);
 	uint end = hsize + plen;
-	for (checkOver(end); dlim < end; dlim += recvNet(socket, &data[dlim], size - dlim));
+	if (dlim - pos < end)	// wait for the rest instead of blocking
+		return false;
 
+	uint slen = end;
+	data[pos] = head;
 	if (mask) {
-		data[1] &= 0x7F;
-		unmask(mask, hsize, end);
-		std::copy_n(&data[hsize], plen, &data[hsize-sizeof(uint32)]);
+		data[pos+1] &= 0x7F;
+		unmask(mask, pos + hsize, pos + end);
+		std::copy_n(&data[pos+hsize], plen, &data[pos+hsize-sizeof(uint32)]);
+		slen -= sizeof(uint32);
 	}
-	sendData(socket, data.get(), end, false);
-	eraseFront(end);
+	if (out)
+		out->write(socket, &data[pos], slen);
+	else
+		sendData(socket, &data[pos], slen, false);
+	return true;
+}
+
+void Buffer::skipFrame(uint len) {
+	if (!fragNext)
+		eraseFront(len);
+	else if (fragNext += len; rpos + fragNext == dlim) {	// nothing left behind the joined payload
+		dlim = rpos + fragEnd;
+		fragNext = fragEnd;
+	}
+}
+
+void Buffer::joinFragments(bool fin) {	// turns the joined payload into one frame, which is final and unmasked or non-final with a zero mask for handing over the buffer
+	uint8 rsv = data[rpos] & 0x40;	// a compressed message gets decompressed as a whole
+	uint plen = fragEnd - fragBegin;
+	uint hsize = wsHeadMin + (plen > UINT16_MAX ? sizeof(uint64) : plen > 125 ? sizeof(uint16) : 0) + (fin ? 0 : sizeof(uint32));
+	std::copy(&data[rpos+fragNext], &data[dlim], &data[rpos+fragEnd]);
+	dlim -= fragNext - fragEnd;
+	if (hsize > fragBegin) {	// a wider length or the zero mask can outgrow the first fragment's header
+		uint shift = hsize - fragBegin;
+		checkOver(dlim + shift);
+		std::copy_backward(&data[rpos+fragBegin], &data[dlim], &data[dlim+shift]);
+		dlim += shift;
+		fragBegin = hsize;
+	}
+
+	rpos += fragBegin - hsize;
+	writeWsHead(&data[rpos], plen);
+	data[rpos] = (fin ? 0x82 : 0x02) | rsv;
+	if (!fin) {
+		data[rpos+1] |= 0x80;
+		std::fill_n(&data[rpos+hsize-sizeof(uint32)], sizeof(uint32), 0);
+	}
+	fragBegin = fragEnd = fragNext = 0;
 }
 
 uint Buffer::readLoadSize(bool webs) const {
-	uint ofs = 0;
+	uint ofs = rpos;
 	if (webs) {
 		ofs += wsHeadMin;
-		if (uint plen = data[1] & 0x7F; plen == 126)
+		if (uint plen = data[rpos+1] & 0x7F; plen == 126)
 			ofs += sizeof(uint16);
 		else if (plen == 127)
 			ofs += sizeof(uint64);
-		if (data[1] & 0x80)
+		if (data[rpos+1] & 0x80)
 			ofs += sizeof(uint32);
 	}
-	return ofs + read16(&data[ofs+1]);
+	return ofs - rpos + readSize(&data[ofs]);
 }
 
 uint Buffer::checkOver(uint end) {
-	if (end >= size)	// if end == size then already allocate the next block
+	if (end >= size) {	// if end == size then already allocate the next block
+		if (rpos) {	// first try to make room by moving the unprocessed data to the front
+			end -= rpos;
+			if (end < size) {
+				std::copy(&data[rpos], &data[dlim], data.get());
+				dlim -= rpos;
+				rpos = 0;
+				return end;
+			}
+		}
 		resize(end);
+	}
 	return end;
 }
 
 void Buffer::eraseFront(uint len) {
-	if (dlim -= len; size - dlim <= sizeStep)	// if dlim == size - sizeStep then still keep the next block
-		std::copy_n(&data[len], dlim, data.get());
-	else
-		resize(dlim, len);
+	if (rpos += len; rpos < dlim)	// just skip the processed data if there's more left
+		return;
+	rpos = dlim = 0;
+	fragBegin = fragEnd = fragNext = 0;
+	if (size > sizeStep)
+		resize(0);
 }
 
-void Buffer::resize(uint lim, uint ofs) {
-	uint nsiz = (lim / sizeStep + 1) * sizeStep;
-	uptr<uint8[]> ndat = std::make_unique<uint8[]>(nsiz);
-	std::copy_n(&data[ofs], dlim, ndat.get());
+void Buffer::resize(uint lim) {
+	uint nsiz = poolRound((lim / sizeStep + 1) * sizeStep);
+	PoolPtr ndat = poolAlloc(nsiz);
+	std::copy(&data[rpos], &data[dlim], ndat.get());
 	data = std::move(ndat);
 	size = nsiz;
+	dlim -= rpos;
+	rpos = 0;
 }
 
 void Buffer::unmask(const uint8* mask, uint ofs, uint end) {
-	for (uint i = ofs; i < end; ++i)
-		data[i] ^= mask[(i - ofs) % sizeof(uint32)];
+	unmaskData(&data[ofs], end - ofs, mask);
 }
 
 }
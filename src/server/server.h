@@ -2,6 +2,7 @@
 
 #include "utils/alias.h"
 #include <stdexcept>
+#include <string_view>
 #ifdef _WIN32
 #include <ws2tcpip.h>
 #else
@@ -12,6 +13,7 @@
 #include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
@@ -37,33 +39,53 @@ using socklent = socklen_t;
 
 constexpr short polleventsDisconnect = POLLERR | POLLHUP | POLLNVAL | POLLRDHUP;
 
+#ifdef DEFLATE
+struct z_stream_s;
+#endif
+
 namespace Com {
 
-constexpr char commonVersion[] = "0.5.3";
+constexpr char commonVersion[] = "0.5.5";
 constexpr char defaultPort[] = "39741";
 constexpr uint16 dataHeadSize = sizeof(uint8) + sizeof(uint16);	// code + size
+constexpr uint16 wideHeadSize = dataHeadSize + sizeof(uint32);	// code + zero size + 32 bit size for messages that don't fit the regular head
+constexpr uint dataSizeLimit = 256 * 1024;	// biggest total size of a wide message
 constexpr uint8 roomNameLimit = 63;
+constexpr uint16 roomPageSize = 64;	// maximum amount of rooms per Code::rpage
+constexpr uint8 roomPageOpen = 0x01;	// Code::rpage request flag for leaving out full rooms
+constexpr uint8 roomDeltaOpen = 0x80;	// Code::rdelta flags that share a byte with the name length
+constexpr uint8 roomDeltaErase = 0x40;
 constexpr uint wsHeadMin = 2;
 constexpr uint wsHeadMax = 2 + sizeof(uint64) + sizeof(uint32);
+constexpr uint poolBlockMin = 512;
+constexpr uint poolBlockMax = 128 * 1024;	// bigger blocks are allocated directly
+constexpr uint poolSlabSize = 64 * 1024;
 
 constexpr char msgAcceptFail[] = "Failed to accept";
 constexpr char msgBindFail[] = "Failed to bind socket";
 constexpr char msgConnectionFail[] = "Failed to connect";
 constexpr char msgConnectionLost[] = "Connection lost";
+constexpr char msgHandoffFail[] = "Failed to hand off sockets";
 constexpr char msgIoctlFail[] = "Failed to ioctl";
 constexpr char msgPollFail[] = "Failed to poll";
 constexpr char msgProtocolError[] = "Protocol error";
 constexpr char msgResolveFail[] = "Failed to resolve host";
+constexpr char msgSendOverflow[] = "Send queue full";
 constexpr char msgWinsockFail[] = "failed to initialize Winsock 2.2";
+constexpr char msgZlibFail[] = "Failed to initialize zlib";
 
-constexpr array<const char*, 1> compatibleVersions = {
-	commonVersion
+constexpr array<const char*, 3> compatibleVersions = {	// newest first
+	commonVersion,
+	"0.5.4",
+	"0.5.3"
 };
+constexpr uint pagedVersions = 2;	// amount of the newest compatible versions that get room pages and deltas instead of full room lists and single room messages
+constexpr uint wideVersions = 1;	// amount of the newest compatible versions that understand the wide head
 
 enum class Code : uint8 {
 	version,	// version info
 	full,		// server full
-	rlist,		// list all rooms (pid + amount + flags + names)
+	rlist,		// list all rooms (pid + amount + flags + names) or the first page of them if the version is paged (same as rpage)
 	rnew,		// create new room (room name)
 	cnrnew,		// confirm new room (CncrnewCode)
 	rerase,		// delete a room (name info)
@@ -84,6 +106,8 @@ enum class Code : uint8 {
 	tile,		// tile type change (tile + type)
 	record,		// turn record data (info + last actor + protected pieces)
 	message,	// local message
+	rpage,		// request a page of rooms (flags + cursor name + prefix name) or receive one (pid + more + amount + flags + names)
+	rdelta,		// room changes of one server iteration (amount + flags + names)
 	wsconn = 'G'	// first letter of websocket handshake
 };
 
@@ -110,10 +134,20 @@ const umap<Code, uint16> codeSizes = {
 // socket functions
 addrinfo* resolveAddress(const char* addr, const char* port, int family);
 nsint createSocket(int family, int reuseaddr, int nodelay = 1);
-nsint bindSocket(const char* port, int family);
+nsint bindSocket(const char* port, int family, int backlog = 8);
 nsint acceptSocket(nsint fd);
+nsint acceptSocketNow(nsint fd);	// for a nonblocking listener (returns INVALID_SOCKET if there's nothing to accept)
 int noblockSocket(nsint fd, bool noblock);
+void keepaliveSocket(nsint fd, uint idle);	// lets the kernel probe a connection after the given seconds of silence
+uint socketRtt(nsint fd);	// the kernel's smoothed round trip time in microseconds or 0 if unknown
 void closeSocket(nsint& fd);
+#ifndef _WIN32
+nsint bindLocal(const char* path);		// listens on a UNIX socket and replaces an existing file at the path
+nsint connectLocal(const char* path);	// returns INVALID_SOCKET if nobody is listening
+void timeoutSocket(nsint fd, uint secs);	// lets blocking sends and receives fail after the given seconds
+void sendHandoff(nsint socket, const uint8* data, uint len, const vector<nsint>& fds);	// passes the data and duplicates of the sockets to another process
+vector<uint8> recvHandoff(nsint socket, vector<nsint>& fds);	// fds gets the received sockets even if it throws
+#endif
 
 inline void closeSocketV(nsint fd) {
 #ifdef _WIN32
@@ -124,10 +158,16 @@ inline void closeSocketV(nsint fd) {
 }
 
 // universal functions
+class Outbox;
+
 void sendWaitClose(nsint socket);
 void sendVersion(nsint socket, bool webs);
+void sendVersion(nsint socket, Outbox& out, bool webs);
 void sendRejection(nsint server);
+void rejectSocket(nsint fd);	// sends Code::full and closes the socket
 void sendData(nsint socket, const uint8* data, uint len, bool webs);
+void sendData(nsint socket, Outbox& out, const uint8* data, uint len, bool webs);
+void unmaskData(uint8* data, uint len, const uint8* mask);	// XORs a WebSocket payload with its 4 byte mask
 string digestSha1(string str);
 string encodeBase64(const string& str);
 
@@ -155,8 +195,20 @@ inline void* write64(void* data, uint64 val) {
 	return writeMem(data, SDL_SwapBE64(val));
 }
 
+inline uint readSize(const uint8* data) {	// total size of a message with a regular or wide head
+	if (uint16 len = read16(data + 1))
+		return len;
+	return read32(data + dataHeadSize);
+}
+
+inline uint readHeadSize(const uint8* data) {
+	return read16(data + 1) ? dataHeadSize : wideHeadSize;
+}
+
 inline string readText(const uint8* data) {
-	return string(reinterpret_cast<const char*>(data + dataHeadSize), read16(data + 1) - dataHeadSize);
+	if (uint16 len = read16(data + 1))	// only a wide head has the 32-bit size
+		return string(reinterpret_cast<const char*>(data + dataHeadSize), len - dataHeadSize);
+	return string(reinterpret_cast<const char*>(data + wideHeadSize), read32(data + dataHeadSize) - wideHeadSize);
 }
 
 inline string readName(const uint8* data, uint8 nmask = 0xFF) {
@@ -168,6 +220,181 @@ struct Error : std::runtime_error {
 	using std::runtime_error::runtime_error;
 };
 
+// a message that's encoded once and can be shared between raw and WebSocket recipients
+class Frame {
+private:
+	static constexpr uint headSpace = wsHeadMax - sizeof(uint32);	// room for an unmasked WebSocket header
+
+	sptr<uint8[]> data;
+	uint wofs = headSpace;	// begin of the WebSocket header
+	uint size = headSpace;
+
+	friend class Outbox;
+public:
+	Frame() = default;
+	Frame(const uint8* msg, uint len);
+
+	const uint8* getData(bool webs) const;
+	uint getSize(bool webs) const;
+	void send(nsint socket, bool webs) const;
+};
+
+inline const uint8* Frame::getData(bool webs) const {
+	return &data[webs ? wofs : headSpace];
+}
+
+inline uint Frame::getSize(bool webs) const {
+	return size - (webs ? wofs : headSpace);
+}
+
+// storage of buffers with a power of two size that's taken from slabs and kept for reuse after being freed
+struct PoolDeleter {
+	uint size = 0;
+
+	void operator()(uint8* ptr) const;
+};
+
+struct PoolStats {
+	uint size;		// block size or 0 for blocks that are too big for the pool
+	uint slabs;
+	uint blocks;	// amount of blocks carved out of the slabs
+	uint used;
+};
+
+using PoolPtr = uptr<uint8[], PoolDeleter>;
+
+PoolPtr poolAlloc(uint size);	// gets a block of at least the given size
+uint poolRound(uint size);		// size of the block that'd be given for the requested size
+vector<PoolStats> poolStats();
+
+#ifdef DEFLATE
+// permessage-deflate state of a WebSocket connection
+struct DeflateEnd {
+	void operator()(z_stream_s* zs) const;
+};
+
+struct InflateEnd {
+	void operator()(z_stream_s* zs) const;
+};
+
+class Deflate {
+public:
+	static constexpr uint8 windowBits = 12;	// the server's compressor doesn't need a bigger window for lobby and game messages
+	static constexpr uint8 maxWindowBits = 15;
+
+	struct Mode {
+		uint8 clientBits = maxWindowBits;	// window of the client's compressor
+		bool serverReset = false;	// no context takeover for messages to the client
+		bool clientReset = false;	// no context takeover for messages from the client
+	};
+
+private:
+	uptr<z_stream_s, DeflateEnd> def;	// created on first use unless the side resets, in which case the thread's streams are shared
+	uptr<z_stream_s, InflateEnd> inf;
+	Mode mode;
+
+public:
+	Deflate(const Mode& how);
+
+	static void configure(uint minSize, bool noContext);	// lets clients negotiate the extension (with minSize UINT_MAX nothing gets compressed)
+	static uptr<Deflate> negotiate(std::string_view offers, string& response);	// takes the first acceptable offer of a Sec-WebSocket-Extensions header and appends the response header
+	const Mode& getMode() const;
+	bool wants(uint len) const;	// whether an outgoing message is big enough to be compressed
+	const uint8* compress(const uint8* msg, uint len, uint& flen);	// returns a compressed WebSocket frame and sets its size or returns nullptr if it wouldn't be smaller (only without context takeover)
+	const uint8* decompress(const uint8* load, uint len, uint& mlen);	// returns the message and sets its size (throws if it's broken or too big)
+	string getWindow() const;	// recently decompressed data that later messages from the client may refer to
+	void setWindow(const uint8* data, uint len);
+};
+
+inline const Deflate::Mode& Deflate::getMode() const {
+	return mode;
+}
+#endif
+
+// outgoing data of a socket that couldn't be sent without blocking
+class Outbox {
+private:
+	struct Chunk {
+		sptr<uint8[]> data;
+		uint pos, end;
+	};
+
+	vector<Chunk> chunks;	// unlike a deque, an empty vector doesn't hold any memory for an idle socket
+	uint front = 0;	// first chunk that hasn't been sent completely
+	uint size = 0;
+	uint limit = UINT_MAX;
+	vector<nsint>* backlog = nullptr;	// gets the socket when data starts being queued, so that the owner can wait for it to be writable
+	bool deferred = false;	// whether writes only queue, because the owner submits the sends itself
+#ifdef DEFLATE
+	uptr<Deflate> zip;	// set if the WebSocket connection negotiated permessage-deflate (also used for receiving)
+#endif
+
+public:
+	bool empty() const;
+	uint getSize() const;
+	uint getLimit() const;
+	void setLimit(uint lim);
+	void setBacklog(vector<nsint>* sockets);
+	void setDeferred(bool on);
+#ifdef DEFLATE
+	Deflate* getDeflate() const;
+	void setDeflate(uptr<Deflate>&& dfl);
+	bool writeDeflated(nsint socket, const uint8* msg, uint len);	// writes the message as a compressed WebSocket frame if it's worth it and returns whether it did
+#endif
+
+	void write(nsint socket, const uint8* data, uint len);	// sends as much as possible and copies the rest (throws if over the limit)
+	void write(nsint socket, const uint8* head, uint hlen, const uint8* data, uint len);	// gathers a separate header and payload into one send
+	void write(nsint socket, const Frame& frame, bool webs);	// queues a reference to the frame instead of a copy
+	void write(nsint socket, const vector<Frame>& frames, bool webs);	// gathers the frames into one send
+	bool flush(nsint socket);	// sends queued chunks in batches and returns true when everything has been sent
+	template <class F> uint gather(uint max, F piece) const;	// calls piece(index, data, size, chunk) for up to max queued chunks and returns how many there were
+	void consume(uint len);	// drops the given amount of sent bytes from the front
+private:
+	void push(nsint socket, Chunk&& chunk);
+};
+
+inline bool Outbox::empty() const {
+	return chunks.empty();
+}
+
+inline uint Outbox::getSize() const {
+	return size;
+}
+
+inline uint Outbox::getLimit() const {
+	return limit;
+}
+
+inline void Outbox::setLimit(uint lim) {
+	limit = lim;
+}
+
+inline void Outbox::setBacklog(vector<nsint>* sockets) {
+	backlog = sockets;
+}
+
+inline void Outbox::setDeferred(bool on) {
+	deferred = on;
+}
+
+#ifdef DEFLATE
+inline Deflate* Outbox::getDeflate() const {
+	return zip.get();
+}
+
+inline void Outbox::setDeflate(uptr<Deflate>&& dfl) {
+	zip = std::move(dfl);
+}
+#endif
+
+template <class F>
+uint Outbox::gather(uint max, F piece) const {
+	uint cnt = 0;
+	for (vector<Chunk>::const_iterator it = chunks.begin() + front; it != chunks.end() && cnt < max; ++it, ++cnt)
+		piece(cnt, &it->data[it->pos], it->end - it->pos, it->data);
+	return cnt;
+}
+
 // for sending/receiving network data (mustn't be used for both simultaneously)
 class Buffer {
 public:
@@ -179,12 +406,18 @@ public:
 		error
 	};
 
+	static constexpr uint sizeStep = 512;	// also the block size of an empty buffer
+
 private:
-	static constexpr uint sizeStep = 512;
 
-	uptr<uint8[]> data;
+	PoolPtr data;
 	uint size = sizeStep;
 	uint dlim = 0;
+	uint rpos = 0;	// begin of unprocessed received data, which only gets moved to the front when running out of space
+	uint fragBegin = 0;	// payload of a fragmented WebSocket message relative to rpos, which gets joined behind the first fragment's header
+	uint fragEnd = 0;
+	uint fragNext = 0;	// next frame relative to rpos or 0 if there's no fragmented message
+	bool pong = false;	// whether a WebSocket pong arrived since the last takePong()
 
 public:
 	Buffer();
@@ -197,9 +430,9 @@ public:
 	void clearCur(bool webs);	// delete first chunk
 
 	uint pushHead(Code code);				// should only be used for codes with fixed length (returns end position of head)
-	uint pushHead(Code code, uint16 dlen);	// should only be used for codes with variable length (returns end position of head)
+	uint pushHead(Code code, uint dlen);	// should only be used for codes with variable length (returns end position of head, which is wide if dlen doesn't fit 16 bits)
 	uint allocate(Code code);				// set head and allocate space in advance (returns end position of head)
-	uint allocate(Code code, uint16 dlen);
+	uint allocate(Code code, uint dlen);
 	void push(uint8 val);
 	void push(uint16 val);
 	void push(uint32 val);
@@ -208,25 +441,38 @@ public:
 	void push(initlist<uint16> lst);
 	void push(initlist<uint32> lst);
 	void push(initlist<uint64> lst);
-	void push(const string& str);
+	void push(std::string_view str);
 	uint write(uint8 val, uint pos);
 	uint write(uint16 val, uint pos);
 	uint write(uint32 val, uint pos);
 	uint write(uint64 val, uint pos);
 
-	void redirect(nsint socket, uint8* pos, bool sendWebs);	// doesn't clear data
+	void redirect(nsint socket, Outbox& out, uint8* pos, bool sendWebs);	// doesn't clear data
 	void send(nsint socket, bool webs, bool clr = true);	// sends and clears all data
-	uint8* recv(nsint socket, bool webs);	// returns begin of data or nullptr if nothing to process yet
+	void send(nsint socket, Outbox& out, bool webs, bool clr = true);
+	uint8* recv(nsint socket, bool webs, Outbox* out = nullptr);	// returns begin of data or nullptr if nothing to process yet (control frame responses go through out if set)
 	bool recvData(nsint socket);	// load recv data into buffer; returns true if the connection closed (call once before iterating over recv()
-	Init recvConn(nsint socket, bool& webs);
+	void recvData(PoolPtr& block, uint len);	// for data that was received elsewhere into a block of sizeStep bytes: an empty buffer swaps it for its own, otherwise the data gets copied
+	void recvData(const uint8* src, uint len);	// appends a copy of data that was received elsewhere
+	const uint8* recvPending(uint& len);	// returns the begin of the received data that hasn't been processed yet and sets its length (a partly joined message gets turned back into a frame)
+	uint8* recvRun(uint& len, Code first, Code last);	// only for raw data: returns the begin of the complete messages in a row with a code in [first, last] and sets their total length or returns nullptr if there are none (a wide message ends the run)
+	void clearRun(uint len);
+	Init recvConn(nsint socket, bool& webs, Outbox* out = nullptr, uint* vid = nullptr);	// vid is set to the index of the accepted version in compatibleVersions
+	bool takePong();
 private:
-	bool recvHead(nsint socket, uint& ofs, uint8*& mask, bool webs);
+	void writeHead(Code code, uint dlen);
+	bool recvHead(nsint socket, uint& ofs, uint8*& mask, bool webs, Outbox* out);
 	uint8* recvLoad(uint ofs, const uint8* mask);
-	void resendWs(nsint socket, uint hsize, uint plen, const uint8* mask);
+	bool resendWs(nsint socket, uint pos, uint hsize, uint plen, const uint8* mask, Outbox* out, uint8 head);
+	void skipFrame(uint len);
+	void joinFragments(bool fin);
+#ifdef DEFLATE
+	void inflateFrame(uint hsize, uint plen, const uint8* mask, Deflate& zip);
+#endif
 	uint readLoadSize(bool webs) const;
 	uint checkOver(uint end);
 	void eraseFront(uint len);
-	void resize(uint lim, uint ofs = 0);
+	void resize(uint lim);
 	void unmask(const uint8* mask, uint ofs, uint end);
 	template <class T, class F> void pushNumber(T val, F writer);
 	template <class T, class F> void pushNumberList(initlist<T> lst, F writer);
@@ -235,7 +481,7 @@ private:
 };
 
 inline Buffer::Buffer() :
-	data(std::make_unique<uint8[]>(sizeStep))
+	data(poolAlloc(sizeStep))
 {}
 
 inline uint8& Buffer::operator[](uint i) {
@@ -246,6 +492,12 @@ inline uint8 Buffer::operator[](uint i) const {
 	return data[i];
 }
 
+inline bool Buffer::takePong() {
+	bool got = pong;
+	pong = false;
+	return got;
+}
+
 inline const uint8* Buffer::getData() const {
 	return data.get();
 }
@@ -254,6 +506,13 @@ inline uint Buffer::getDlim() const {
 	return dlim;
 }
 
+inline const uint8* Buffer::recvPending(uint& len) {
+	if (fragNext)
+		joinFragments(false);
+	len = dlim - rpos;
+	return &data[rpos];
+}
+
 inline void Buffer::clear() {
 	eraseFront(dlim);
 }
@@ -262,6 +521,10 @@ inline void Buffer::clearCur(bool webs) {
 	eraseFront(readLoadSize(webs));
 }
 
+inline void Buffer::clearRun(uint len) {
+	eraseFront(len);
+}
+
 inline uint Buffer::pushHead(Code code) {
 	return pushHead(code, codeSizes.at(code));
 }
@@ -1,25 +1,47 @@
 #include "log.h"
-#include "server.h"
+#include "metrics.h"
+#include "poller.h"
+#include "timer.h"
+#include <atomic>
+#include <chrono>
 #include <csignal>
+#include <mutex>
+#include <string_view>
+#include <thread>
 #ifdef _WIN32
 #include <conio.h>
-#elif !defined(SERVICE)
+#else
+#include <sys/resource.h>
+#ifndef SERVICE
 #include <termios.h>
 #endif
+#endif
 using namespace Com;
 
 struct Player;
 
 static bool cprocValidate(nsint pfd, Player& player);
 static bool cprocPlayer(nsint pfd, Player& player);
+static bool cprocDepart(nsint pfd, Player& player);
 
 // PLAYER
 
 struct Player {
 	Buffer recvb;
+	Outbox outbox;
 	bool (*cproc)(nsint, Player&) = cprocValidate;
 	nsint partner = INVALID_SOCKET;
+	uint dropped = 0;	// amount of lobby messages that were skipped because of a full outbox
+	uint timer = TimerWheel::none;
+	uint lobbyId = UINT_MAX;	// index in lobby or UINT_MAX if the player isn't in the lobby
+	uint rtt = 0;		// round trip time in microseconds
+	uint64 active = 0;	// time of the last received data in microseconds
+	uint64 pingTime = 0;	// when the last WebSocket ping was sent
 	bool webs = false;
+	bool paged = false;	// whether the client's version gets room pages instead of full room lists
+	bool wide = false;	// whether the client's version understands messages with a wide head
+	bool waitOut = false;	// whether the poller is watching for the socket to become writable
+	bool pingWait = false;	// whether the last ping hasn't been answered yet
 };
 
 // PLAYER ERROR
@@ -39,6 +61,287 @@ PlayerError::PlayerError(initlist<nsint> fds) :
 	pfds(fds)
 {}
 
+// PLAYER TABLE
+
+// players of a shard in a flat table indexed by socket with stable addresses (erasing moves the last entry into the gap, so only iterators to it get invalidated)
+class PlayerTable {
+public:
+	using value_type = pair<const nsint, Player>;
+	static constexpr uint entryMemory = sizeof(value_type) + sizeof(uptr<value_type>) + sizeof(uint);
+
+	class iterator {
+	private:
+		vector<uptr<value_type>>::iterator pos;
+
+	public:
+		iterator(vector<uptr<value_type>>::iterator it);
+
+		value_type& operator*() const;
+		value_type* operator->() const;
+		iterator& operator++();
+		bool operator==(const iterator& it) const;
+		bool operator!=(const iterator& it) const;
+	};
+
+private:
+	vector<uint> ids;	// index in entries by socket or UINT_MAX
+	vector<uptr<value_type>> entries;
+
+public:
+	iterator begin();
+	iterator end();
+	iterator find(nsint fd);
+	Player& at(nsint fd);
+	sizet count(nsint fd) const;
+	sizet size() const;
+	pair<iterator, bool> emplace(nsint fd, Player&& player);
+	void erase(iterator it);
+	void clear();
+};
+
+PlayerTable::iterator::iterator(vector<uptr<value_type>>::iterator it) :
+	pos(it)
+{}
+
+PlayerTable::value_type& PlayerTable::iterator::operator*() const {
+	return **pos;
+}
+
+PlayerTable::value_type* PlayerTable::iterator::operator->() const {
+	return pos->get();
+}
+
+PlayerTable::iterator& PlayerTable::iterator::operator++() {
+	++pos;
+	return *this;
+}
+
+bool PlayerTable::iterator::operator==(const iterator& it) const {
+	return pos == it.pos;
+}
+
+bool PlayerTable::iterator::operator!=(const iterator& it) const {
+	return pos != it.pos;
+}
+
+PlayerTable::iterator PlayerTable::begin() {
+	return entries.begin();
+}
+
+PlayerTable::iterator PlayerTable::end() {
+	return entries.end();
+}
+
+PlayerTable::iterator PlayerTable::find(nsint fd) {
+	return count(fd) ? entries.begin() + ids[fd] : entries.end();
+}
+
+Player& PlayerTable::at(nsint fd) {
+	if (!count(fd))
+		throw std::out_of_range("no player with socket " + toStr(fd));
+	return entries[ids[fd]]->second;
+}
+
+sizet PlayerTable::count(nsint fd) const {
+	return sizet(fd) < ids.size() && ids[fd] != UINT_MAX;
+}
+
+sizet PlayerTable::size() const {
+	return entries.size();
+}
+
+pair<PlayerTable::iterator, bool> PlayerTable::emplace(nsint fd, Player&& player) {
+	if (count(fd))
+		return pair(entries.begin() + ids[fd], false);
+	if (sizet(fd) >= ids.size())
+		ids.resize(sizet(fd) + 1, UINT_MAX);
+	ids[fd] = uint(entries.size());
+	entries.push_back(std::make_unique<value_type>(fd, std::move(player)));
+	return pair(entries.end() - 1, true);
+}
+
+void PlayerTable::erase(iterator it) {
+	uint id = ids[it->first];
+	ids[it->first] = UINT_MAX;
+	if (id != entries.size() - 1) {
+		entries[id] = std::move(entries.back());
+		ids[entries[id]->first] = id;
+	}
+	entries.pop_back();
+}
+
+void PlayerTable::clear() {
+	entries.clear();
+	ids.clear();
+}
+
+// ROOM DIRECTORY
+
+struct RoomListing {
+	string name;
+	nsint host;
+	nsint guest;
+};
+
+// names of the rooms of all shards, locked because a claim has to check and insert a name at once across shards, which only happens when a room is created, joined or erased
+class RoomDirectory {
+private:
+	std::mutex mtx;
+	umap<string, uint> names;	// room name, shard id
+
+public:
+	CncrnewCode claim(const string& name, uint sid, uint limit);
+	void release(const string& name);
+	uint find(const string& name);	// returns UINT_MAX if there's no such room
+	uint size();
+};
+
+CncrnewCode RoomDirectory::claim(const string& name, uint sid, uint limit) {
+	std::lock_guard lock(mtx);
+	if (names.size() >= limit)
+		return CncrnewCode::full;
+	return names.emplace(name, sid).second ? CncrnewCode::ok : CncrnewCode::taken;
+}
+
+void RoomDirectory::release(const string& name) {
+	std::lock_guard lock(mtx);
+	names.erase(name);
+}
+
+uint RoomDirectory::find(const string& name) {
+	std::lock_guard lock(mtx);
+	umap<string, uint>::iterator it = names.find(name);
+	return it != names.end() ? it->second : UINT_MAX;
+}
+
+uint RoomDirectory::size() {
+	std::lock_guard lock(mtx);
+	return uint(names.size());
+}
+
+// ROOM EVENT
+
+enum class RoomState : uint8 {
+	none,
+	open,
+	full
+};
+
+// how a room changed during an iteration
+struct RoomEvent {
+	RoomState prev;	// before the first change
+	RoomState next;	// after the last change
+};
+
+// SHARD MAIL
+
+struct Mail {
+	enum class Type : uint8 {
+		connect,	// take over a newly accepted socket
+		join,		// take over a player that wants to join a room of this shard
+		broadcast,	// forward room changes or a global message to the lobby players
+		restore		// take over a player of the previous process (name is set if it hosts a room)
+	};
+
+	Type type;
+	nsint fd = INVALID_SOCKET;
+	optional<Player> player;
+	string name;
+	vector<Frame> frames;
+	vector<Frame> legacy;	// replaces frames for older clients if it isn't empty
+
+	Mail(Type mtype, nsint socket = INVALID_SOCKET);
+};
+
+Mail::Mail(Type mtype, nsint socket) :
+	type(mtype),
+	fd(socket)
+{}
+
+// SAVED PLAYER
+
+// a player that gets handed over to the next process
+struct Saved {
+	nsint fd;
+	Player player;
+	string room;	// name of the room if the player is its host
+	string join;	// room that the player was about to join
+	bool lobby;
+
+	Saved(nsint socket, Player&& plr, string&& rname = string(), string&& jname = string(), bool inLobby = false);
+};
+
+Saved::Saved(nsint socket, Player&& plr, string&& rname, string&& jname, bool inLobby) :
+	fd(socket),
+	player(std::move(plr)),
+	room(std::move(rname)),
+	join(std::move(jname)),
+	lobby(inLobby)
+{}
+
+// SHARD
+
+// an event loop with its own players and rooms
+struct Shard {
+	uptr<Poller> poller;
+	std::thread thread;
+	std::mutex mailMutex;
+	vector<Mail> mail;
+	std::atomic<const vector<RoomListing>*> listing = new vector<RoomListing>;	// swapped by the owner, the others read it through a ListingReader
+	std::atomic<uint64> reading = 0;	// listing epoch when this shard's loop started reading the others' listings or 0
+	vector<pair<uint64, const vector<RoomListing>*>> retired;	// swapped out listings and the epoch when that happened
+	std::atomic<uint> playerCount = 0;
+	nsint wake[2] = { INVALID_SOCKET, INVALID_SOCKET };	// pipe for waking the loop when mail arrives
+	uint id;
+	Counters counters;
+	vector<Saved> saved;	// players that are about to be handed over
+
+	Shard(uint sid);
+	~Shard();
+
+	void post(Mail&& msg);
+	vector<Mail> takeMail();
+};
+
+Shard::Shard(uint sid) :
+	id(sid)
+{}
+
+Shard::~Shard() {
+	delete listing.load();
+	for (auto [epoch, old] : retired)
+		delete old;
+	for (Mail& it : mail)
+		if (it.fd != INVALID_SOCKET)
+			closeSocketV(it.fd);
+#ifndef _WIN32
+	for (nsint fd : wake)
+		if (fd != INVALID_SOCKET)
+			close(fd);
+#endif
+}
+
+void Shard::post(Mail&& msg) {
+	std::lock_guard lock(mailMutex);
+	mail.push_back(std::move(msg));
+#ifndef _WIN32
+	if (mail.size() == 1) {	// the loop will read all mail at once, so it only needs to be woken up once
+		uint8 sig = 0;
+		ssize_t rc = write(wake[1], &sig, sizeof(sig));
+		(void)rc;
+	}
+#endif
+}
+
+vector<Mail> Shard::takeMail() {
+#ifndef _WIN32
+	uint8 sigs[64];
+	while (read(wake[0], sigs, sizeof(sigs)) > 0);
+#endif
+	std::lock_guard lock(mailMutex);
+	return std::move(mail);
+}
+
 // TERMINAL
 
 #if !defined(_WIN32) && !defined(SERVICE)
@@ -66,22 +369,121 @@ Terminal::~Terminal() {
 // SERVER
 
 constexpr uint32 checkTimeout = 500;
+constexpr uint64 handshakeTimeout = 10000000;	// microseconds until a new connection has to pass the version check
+constexpr uint8 wsPing[] = { 0x89, 0x00 };
+constexpr uint defaultHeartbeat = 30;
+constexpr uint defaultLobbyTimeout = 0;
 constexpr uint defaultMaxPlayers = 1024;
-constexpr uint maxPlayersLimit = 2040;
+constexpr uint maxPlayersLimit = 1 << 20;	// the open file limit usually lowers it further
+constexpr uint reservedFiles = 32;	// for listeners, log files and the like, which don't include the pollers and pipes of the shards
+constexpr uint maxThreadsLimit = 64;
+constexpr uint defaultSendLimit = 512 * 1024;
+constexpr int defaultListenBacklog = 128;
+constexpr uint acceptBudget = 64;	// maximum number of connections to accept per iteration
+constexpr std::chrono::seconds acceptReportInterval(10);
+constexpr uint32 handoffMagic = 0x54485248;	// "THRH"
+#ifdef DEFLATE
+constexpr uint16 handoffFormat = 0x8003;	// needs to be increased whenever the saved state changes (the top bit marks builds that can continue compressed connections)
+#else
+constexpr uint16 handoffFormat = 3;
+#endif
+constexpr uint handoffHeadSize = sizeof(handoffMagic) + sizeof(handoffFormat) + sizeof(uint8);	// magic + format + whether there's a metrics listener
+constexpr uint handoffTimeout = 10;	// seconds
+constexpr uint8 savedValid = 0x01;	// flags of a saved player
+constexpr uint8 savedWebs = 0x02;
+constexpr uint8 savedPaged = 0x04;
+constexpr uint8 savedDeflate = 0x08;
+constexpr uint8 savedWide = 0x10;
+constexpr uint8 savedServerReset = 0x01;	// flags of a saved permessage-deflate mode
+constexpr uint8 savedClientReset = 0x02;
 constexpr char argPort = 'p';
 constexpr char arg4 = '4';
 constexpr char arg6 = '6';
 constexpr char argMaxPlayers = 'c';
 constexpr char argLog = 'l';
 constexpr char argMaxLogs = 'm';
+constexpr char argThreads = 't';
+constexpr char argSendLimit = 'q';
+constexpr char argDropSlow = 'd';
+constexpr char argRelayRuns = 'r';
+constexpr char argUring = 'u';
+constexpr char argBacklog = 'b';
+constexpr char argMetrics = 'e';
+constexpr char argHeartbeat = 'k';
+constexpr char argLobbyTimeout = 'i';
+constexpr char argHandoff = 's';
+constexpr char argDeflate = 'z';
+constexpr char argNoContext = 'x';
 constexpr char argVerbose = 'v';
 
-static bool running = true;
+static std::atomic<bool> running = true;
 static uint maxPlayers;
-static Buffer sendb;
-static umap<nsint, Player> players;	// socket, player data
-static umap<nsint, string> rooms;	// host socket, room name
+static uint sendLimit;
+static bool dropSlow;
+static bool relayRuns;	// whether raw partners get all complete match messages of a receive in one send
+static uint64 heartbeat;	// interval of WebSocket pings and TCP keepalive in microseconds (0 to disable)
+static uint64 lobbyTimeout;	// in microseconds (0 to disable)
+static std::atomic<uint> playerTotal = 0;
+static nsint server = INVALID_SOCKET;
+static nsint metricsServer = INVALID_SOCKET;
+static nsint handoffServer = INVALID_SOCKET;	// UNIX socket where a new process can ask to take over
+static std::atomic<nsint> handoffSocket = INVALID_SOCKET;	// connection to the process that's taking over
+static const char* handoffPath = nullptr;
+static std::thread metricsThread;
+static uint acceptCount = 0;	// connections accepted and rejected since acceptStart
+static uint rejectCount = 0;
+static std::chrono::steady_clock::time_point acceptStart, acceptLast;	// times of the first and last connection since the last report
+static vector<uptr<Shard>> shards;
+static RoomDirectory directory;
+static std::atomic<uint64> listingEpoch = 1;	// counts swapped out listings, 0 is reserved for shards that aren't reading any
 static Log slog;
+static thread_local Shard* shard;
+static thread_local uptr<Poller> poller;
+static thread_local uptr<TimerWheel> timers;
+static thread_local uint64 loopTime;	// when the current iteration started in microseconds
+static thread_local Buffer sendb;
+static thread_local PlayerTable players;
+static thread_local umap<nsint, string> rooms;	// host socket, room name
+static thread_local vector<pair<nsint, Player*>> lobby;	// players that passed the version check and aren't in a room
+static thread_local umap<std::string_view, nsint> roomHosts;	// room name (owned by rooms), host socket
+static thread_local vector<nsint> backlog;	// players whose outbox started queueing during the current iteration
+static thread_local vector<pair<uint, Mail>> departures;	// shard id, players to be moved after the current iteration
+static thread_local umap<string, RoomEvent> roomEvents;	// room name, changes to be sent to the lobby at the end of the current iteration
+static thread_local uset<nsint> lobbyErrors;	// lobby players that failed to receive room changes
+static thread_local bool roomsChanged = false;
+
+// keeps the other shards' listings from being freed while the current shard reads them, can't be nested
+class ListingReader {
+public:
+	ListingReader();
+	~ListingReader();
+	ListingReader(const ListingReader&) = delete;
+	ListingReader& operator=(const ListingReader&) = delete;
+
+	const vector<RoomListing>& operator()(const Shard& sh) const;
+};
+
+ListingReader::ListingReader() {
+	shard->reading = listingEpoch.load();	// a listing that was swapped out before this epoch can't be seen anymore
+}
+
+ListingReader::~ListingReader() {
+	shard->reading.store(0, std::memory_order_release);
+}
+
+const vector<RoomListing>& ListingReader::operator()(const Shard& sh) const {
+	return *sh.listing.load();
+}
+
+template <class... A>
+static void sendError(A&&... args) {
+	bump(shard->counters.sendErrors);
+	slog.err(std::forward<A>(args)...);
+}
+
+static uint64 steadyTime() {	// in microseconds
+	return uint64(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
 
 static uint maxRooms() {
 	return maxPlayers / 2 + maxPlayers % 2;
@@ -91,137 +493,347 @@ template <class T>
 void rekeyRoom(T room, nsint key) {
 	umap<nsint, string>::node_type rnode = rooms.extract(room);
 	rnode.key() = key;
-	rooms.insert(std::move(rnode));
+	roomHosts.at(rooms.insert(std::move(rnode)).position->second) = key;	// the node keeps its string, so the view stays valid
+	roomsChanged = true;
 }
 
-static void sendRoomList(nsint pfd, Player& player, Code code = Code::rlist) {
-	uint ofs = sendb.pushHead(code, 0) - sizeof(uint16);
-	sendb.push(uint64(pfd));
-	sendb.push(uint16(rooms.size()));
-	for (auto& [host, name] : rooms) {
-		sendb.push({ uint8(((players.at(host).partner == INVALID_SOCKET) << 7) | name.length()) });
-		sendb.push(name);
+static void publishRooms() {
+	vector<RoomListing> listing;
+	listing.reserve(rooms.size());
+	for (auto& [host, name] : rooms)
+		listing.push_back({ name, host, players.at(host).partner });
+	const vector<RoomListing>* old = shard->listing.exchange(new vector<RoomListing>(std::move(listing)));
+	shard->retired.emplace_back(listingEpoch.fetch_add(1), old);
+	roomsChanged = false;
+
+	uint64 oldest = UINT64_MAX;	// free the retired listings that no shard can still be reading
+	for (const uptr<Shard>& it : shards)
+		if (uint64 epoch = it->reading.load(); epoch && epoch < oldest)
+			oldest = epoch;
+	vector<pair<uint64, const vector<RoomListing>*>>::iterator end = std::find_if(shard->retired.begin(), shard->retired.end(), [oldest](const pair<uint64, const vector<RoomListing>*>& it) -> bool { return it.first >= oldest; });
+	for (vector<pair<uint64, const vector<RoomListing>*>>::iterator it = shard->retired.begin(); it != end; ++it)
+		delete it->second;
+	shard->retired.erase(shard->retired.begin(), end);
+}
+
+static void enterLobby(nsint pfd, Player& player) {	// only after the version check, because a raw message would break a pending WebSocket handshake
+	if (player.lobbyId == UINT_MAX) {
+		player.lobbyId = uint(lobby.size());
+		lobby.emplace_back(pfd, &player);
+		if (lobbyTimeout) {	// a player that comes back from a room might not have had anything to check there
+			if (player.timer != TimerWheel::none)
+				timers->cancel(player.timer);
+			player.timer = timers->add(pfd, loopTime);
+		}
 	}
-	sendb.write(uint16(sendb.getDlim()), ofs);
-	sendb.send(pfd, player.webs);
 }
 
-static void sendRoomData(Code code, const string& name, initlist<uint8> extra, uset<nsint>& errPfds) {
-	uint ofs = sendb.pushHead(code, 0) - sizeof(uint16);
-	sendb.push(extra);
-	sendb.push(uint8(name.length()));
-	sendb.push(name);
-	sendb.write(uint16(sendb.getDlim()), ofs);
-	for (auto& [pfd, player] : players)
-		if (player.partner == INVALID_SOCKET && !rooms.count(pfd)) {
+static void exitLobby(Player& player) {
+	if (player.lobbyId != UINT_MAX) {
+		lobby[player.lobbyId] = lobby.back();
+		lobby[player.lobbyId].second->lobbyId = player.lobbyId;
+		lobby.pop_back();
+		player.lobbyId = UINT_MAX;
+	}
+}
+
+static void sendLobby(const vector<Frame>& frames, uset<nsint>& errPfds, nsint skip = INVALID_SOCKET, const vector<Frame>& legacy = {}) {	// legacy replaces frames for older clients if it isn't empty
+	for (auto [pfd, player] : lobby)
+		if (pfd != skip) {
+			const vector<Frame>& out = player->paged || legacy.empty() ? frames : legacy;
+			if (dropSlow) {
+				uint size = player->outbox.getSize();
+				for (const Frame& it : out)
+					size += it.getSize(player->webs);
+				if (size > player->outbox.getLimit()) {
+					++player->dropped;
+					bump(shard->counters.dropped);
+					continue;
+				}
+			}
 			try {
-				sendb.send(pfd, player.webs, false);
+				player->outbox.write(pfd, out, player->webs);
 			} catch (const Error& err) {
 				errPfds.insert(pfd);
-				slog.err("failed to send room data ", uint(code), " of ", name, " to player ", pfd, ": ", err.what());
+				sendError("failed to send data with code ", uint(out[0].getData(false)[0]), " to lobby player ", pfd, ": ", err.what());
 			}
 		}
+}
+
+static void shareLobby(const vector<Frame>& frames, const vector<Frame>& legacy = {}) {
+	for (const uptr<Shard>& it : shards)
+		if (it.get() != shard) {
+			Mail msg(Mail::Type::broadcast);
+			msg.frames = frames;
+			msg.legacy = legacy;
+			it->post(std::move(msg));
+		}
+}
+
+static void queueRoom(const string& name, RoomState prev, RoomState next) {
+	if (auto [it, fresh] = roomEvents.try_emplace(name, RoomEvent{ prev, next }); !fresh)
+		it->second.next = next;
+	roomsChanged = true;
+}
+
+static Frame makeRoomFrame(Code code, const string& name, initlist<uint8> extra = {}) {
+	uint ofs = sendb.pushHead(code, 0) - sizeof(uint16);
+	sendb.push(extra);
+	sendb.push(uint8(name.length()));
+	sendb.push(name);
+	sendb.write(uint16(sendb.getDlim()), ofs);
+	Frame frame(sendb.getData(), sendb.getDlim());
 	sendb.clear();
+	return frame;
 }
 
-static void sendRoomData(Code code, const string& name, initlist<uint8> extra = {}) {
-	uset<nsint> errPfds;
-	if (sendRoomData(code, name, extra, errPfds); !errPfds.empty())
-		throw PlayerError(std::move(errPfds));
+static void flushRooms(nsint skip = INVALID_SOCKET) {	// errors are collected in lobbyErrors
+	vector<Frame> legacy;	// older clients get the single messages of the net changes
+	for (auto& [name, ev] : roomEvents) {
+		if (ev.prev == ev.next)	// the changes cancelled each other out
+			continue;
+		if (ev.next == RoomState::none)
+			legacy.push_back(makeRoomFrame(Code::rerase, name));
+		else {
+			if (ev.prev == RoomState::none)
+				legacy.push_back(makeRoomFrame(Code::rnew, name));
+			if (ev.prev != RoomState::none || ev.next == RoomState::full)
+				legacy.push_back(makeRoomFrame(Code::ropen, name, { uint8(ev.next == RoomState::open) }));
+		}
+	}
+
+	vector<Frame> delta;
+	uint16 cnt = 0;
+	uint ofs = 0;
+	for (auto& [name, ev] : roomEvents) {
+		if (ev.prev == ev.next)
+			continue;
+		if (cnt && sendb.getDlim() + 1 + name.length() > UINT16_MAX) {	// split the delta if it doesn't fit into one message
+			sendb.write(cnt, ofs + sizeof(uint16));
+			sendb.write(uint16(sendb.getDlim()), ofs);
+			delta.emplace_back(sendb.getData(), sendb.getDlim());
+			sendb.clear();
+			cnt = 0;
+		}
+		if (!cnt) {
+			ofs = sendb.pushHead(Code::rdelta, 0) - sizeof(uint16);
+			sendb.push(uint16(0));
+		}
+		sendb.push(uint8((ev.next == RoomState::none ? roomDeltaErase : ev.next == RoomState::open ? roomDeltaOpen : 0) | name.length()));
+		sendb.push(name);
+		++cnt;
+	}
+	if (cnt) {
+		sendb.write(cnt, ofs + sizeof(uint16));
+		sendb.write(uint16(sendb.getDlim()), ofs);
+		delta.emplace_back(sendb.getData(), sendb.getDlim());
+		sendb.clear();
+	}
+	roomEvents.clear();
+
+	if (!delta.empty()) {
+		shareLobby(delta, legacy);
+		sendLobby(delta, lobbyErrors, skip, legacy);
+	}
+}
+
+static void sendRoomPage(nsint pfd, Player& player, Code code, bool openOnly = false, std::string_view cursor = std::string_view(), std::string_view prefix = std::string_view()) {
+	ListingReader listing;	// keeps the names of other shards' rooms alive
+	vector<pair<std::string_view, bool>> found;	// name, open
+	auto match = [&found, openOnly, cursor, prefix](std::string_view name, bool open) {
+		if ((open || !openOnly) && (cursor.empty() || name > cursor) && name.substr(0, prefix.length()) == prefix)
+			found.emplace_back(name, open);
+	};
+	for (auto& [host, name] : rooms)
+		match(name, players.at(host).partner == INVALID_SOCKET);
+	for (const uptr<Shard>& it : shards)
+		if (it.get() != shard)
+			for (const RoomListing& room : listing(*it))
+				match(room.name, room.guest == INVALID_SOCKET);
+
+	bool more = found.size() > roomPageSize;
+	if (more) {	// only the first names after the cursor need to be in order
+		std::nth_element(found.begin(), found.begin() + roomPageSize, found.end());
+		found.resize(roomPageSize);
+	}
+	std::sort(found.begin(), found.end());
+
+	uint ofs = sendb.pushHead(code, 0) - sizeof(uint16);
+	sendb.push(uint64(pfd));
+	sendb.push(uint8(more));
+	sendb.push(uint16(found.size()));
+	for (auto [name, open] : found) {
+		sendb.push(uint8((open << 7) | name.length()));
+		sendb.push(name);
+	}
+	sendb.write(uint16(sendb.getDlim()), ofs);
+	sendb.send(pfd, player.outbox, player.webs);
+}
+
+static void sendRoomList(nsint pfd, Player& player, Code code = Code::rlist) {
+	if (!roomEvents.empty())	// the list already contains the pending changes
+		flushRooms(pfd);
+	if (player.paged) {
+		sendRoomPage(pfd, player, code);
+		return;
+	}
+
+	uint16 cnt = 0;
+	uint ofs = sendb.pushHead(code, 0) - sizeof(uint16);
+	sendb.push(uint64(pfd));
+	uint cofs = sendb.getDlim();
+	sendb.push(uint16(0));
+	auto push = [&cnt](const string& name, bool open) -> bool {
+		if (sendb.getDlim() + 1 + name.length() > UINT16_MAX)	// older clients have to make do with the rooms that fit
+			return false;
+		sendb.push(uint8((open << 7) | name.length()));
+		sendb.push(name);
+		++cnt;
+		return true;
+	};
+	bool fits = true;
+	for (umap<nsint, string>::iterator it = rooms.begin(); fits && it != rooms.end(); ++it)
+		fits = push(it->second, players.at(it->first).partner == INVALID_SOCKET);
+	ListingReader listing;
+	for (vector<uptr<Shard>>::iterator sit = shards.begin(); fits && sit != shards.end(); ++sit)
+		if (sit->get() != shard) {
+			const vector<RoomListing>& others = listing(**sit);
+			for (vector<RoomListing>::const_iterator it = others.begin(); fits && it != others.end(); ++it)
+				fits = push(it->name, it->guest == INVALID_SOCKET);
+		}
+	sendb.write(cnt, cofs);
+	sendb.write(uint16(sendb.getDlim()), ofs);
+	sendb.send(pfd, player.outbox, player.webs);
+}
+
+static void requestRoomPage(const uint8* data, nsint pfd, Player& player) {
+	const uint8* pos = data + dataHeadSize;
+	const uint8* end = data + read16(data + 1);
+	std::string_view names[2];	// cursor, prefix
+	bool valid = pos < end;
+	uint8 flags = valid ? *pos++ : 0;
+	for (std::string_view& it : names)
+		if (valid = valid && pos < end && *pos < end - pos; valid) {
+			it = std::string_view(reinterpret_cast<const char*>(pos + 1), *pos);
+			pos += *pos + 1;
+		}
+	if (!valid) {
+		slog.err("invalid room page request from player ", pfd);
+		throw PlayerError{ pfd };
+	}
+
+	try {
+		sendRoomPage(pfd, player, Code::rpage, flags & roomPageOpen, names[0], names[1]);
+	} catch (const Error& err) {
+		sendb.clear();
+		sendError("failed to send room page to player ", pfd, ": ", err.what());
+		throw PlayerError{ pfd };
+	}
 }
 
 static void createRoom(const uint8* data, nsint pfd, Player& player) {
 	string name = readName(data);
-	CncrnewCode code = CncrnewCode::ok;
-	if (name.length() > roomNameLimit)
-		code = CncrnewCode::length;
-	else if (rooms.size() >= maxRooms())
-		code = CncrnewCode::full;
-	else if (std::any_of(rooms.begin(), rooms.end(), [&name](const pair<const nsint, string>& it) -> bool { return it.second == name; }))
-		code = CncrnewCode::taken;
-
+	CncrnewCode code = name.length() <= roomNameLimit ? directory.claim(name, shard->id, maxRooms()) : CncrnewCode::length;
 	try {
 		sendb.pushHead(Code::cnrnew);
 		sendb.push(uint8(code));
-		sendb.send(pfd, player.webs);
+		sendb.send(pfd, player.outbox, player.webs);
 	} catch (const Error& err) {
 		sendb.clear();
-		slog.err("failed to send host ", code == CncrnewCode::ok ? "accept" : "rejection", " to player ", pfd, ": ", err.what());
+		if (code == CncrnewCode::ok)
+			directory.release(name);
+		sendError("failed to send host ", code == CncrnewCode::ok ? "accept" : "rejection", " to player ", pfd, ": ", err.what());
 		throw PlayerError{ pfd };
 	}
 	if (code == CncrnewCode::ok) {
 		umap<nsint, string>::iterator it = rooms.emplace(pfd, std::move(name)).first;
-		sendRoomData(Code::rnew, it->second);
+		roomHosts.emplace(it->second, pfd);
+		exitLobby(player);
+		queueRoom(it->second, RoomState::none, RoomState::open);
 	}
 }
 
-static void joinRoom(const uint8* data, nsint pfd, Player& player) {
-	string name = readName(data);
-	umap<nsint, string>::iterator room = std::find_if(rooms.begin(), rooms.end(), [&name](const pair<const nsint, string>& it) -> bool { return it.second == name; });
-	if (umap<nsint, Player>::iterator host = room != rooms.end() ? players.find(room->first) : players.end(); host != players.end() && host->second.partner == INVALID_SOCKET) {
+static void joinRoom(const string& name, nsint pfd, Player& player) {
+	umap<std::string_view, nsint>::iterator room = roomHosts.find(name);
+	if (PlayerTable::iterator host = room != roomHosts.end() ? players.find(room->second) : players.end(); host != players.end() && host->second.partner == INVALID_SOCKET) {
 		try {
 			sendb.pushHead(Code::hello);
-			sendb.send(room->first, host->second.webs);
+			sendb.send(host->first, host->second.outbox, host->second.webs);
 		} catch (const Error& err) {
-			slog.err("failed to send join request from player ", pfd, " to player ", room->first, ": ", err.what());
+			sendError("failed to send join request from player ", pfd, " to player ", host->first, ": ", err.what());
 			sendb.clear();
 			try {
 				sendb.pushHead(Code::cnjoin, Com::dataHeadSize + 1);
 				sendb.push(uint8(false));
-				sendb.send(pfd, player.webs);
+				sendb.send(pfd, player.outbox, player.webs);
 			} catch (const Error& e) {
 				sendb.clear();
-				slog.err("failed to send join rejection to player ", pfd, ": ", e.what());
-				throw PlayerError{ pfd, room->first };
+				sendError("failed to send join rejection to player ", pfd, ": ", e.what());
+				throw PlayerError{ pfd, host->first };
 			}
-			throw PlayerError{ room->first };
+			throw PlayerError{ host->first };
 		}
-		player.partner = room->first;
+		player.partner = host->first;
 		host->second.partner = pfd;
-		sendRoomData(Code::ropen, name, { uint8(false) });
+		exitLobby(player);
+		queueRoom(name, RoomState::open, RoomState::full);
 	} else {
 		try {
 			sendb.pushHead(Code::cnjoin, Com::dataHeadSize + 1);
 			sendb.push(uint8(false));
-			sendb.send(pfd, player.webs);
+			sendb.send(pfd, player.outbox, player.webs);
 		} catch (const Error& err) {
 			sendb.clear();
-			slog.err("failed to send join rejection to player ", pfd, ": ", err.what());
+			sendError("failed to send join rejection to player ", pfd, ": ", err.what());
 			throw PlayerError{ pfd };
 		}
 	}
 }
 
+static void joinRoom(const uint8* data, nsint pfd, Player& player) {
+	string name = readName(data);
+	if (uint sid = directory.find(name); sid < shards.size() && sid != shard->id && player.partner == INVALID_SOCKET && !rooms.count(pfd)) {
+		Mail msg(Mail::Type::join, pfd);	// the room belongs to another shard, so the player has to move there first
+		msg.name = std::move(name);
+		departures.emplace_back(sid, std::move(msg));
+		player.cproc = cprocDepart;
+	} else
+		joinRoom(name, pfd, player);
+}
+
 static void leaveRoom(nsint pfd, Player& player, Code listCode = Code::rlist) {	// use Code::version to not send a room list
 	uset<nsint> errPfds;
-	umap<nsint, Player>::iterator partner = players.find(player.partner);
+	PlayerTable::iterator partner = players.find(player.partner);
 	if (umap<nsint, string>::iterator room = rooms.find(pfd); room == rooms.end()) {	// is a guest
 		room = rooms.find(partner->first);
-		sendRoomData(Code::ropen, room->second, { uint8(true) }, errPfds);
+		queueRoom(room->second, RoomState::full, RoomState::open);
 	} else if (partner == players.end()) {	// is a host without guest
-		sendRoomData(Code::rerase, room->second, {}, errPfds);
+		queueRoom(room->second, RoomState::open, RoomState::none);
+		directory.release(room->second);
+		roomHosts.erase(room->second);
 		rooms.erase(room);
 	} else {	// is host with guest
-		sendRoomData(Code::ropen, room->second, { uint8(true) }, errPfds);
+		queueRoom(room->second, RoomState::full, RoomState::open);
 		rekeyRoom(room, partner->first);
 	}
 
 	if (partner != players.end()) {
 		try {
 			sendb.pushHead(Code::leave);
-			sendb.send(partner->first, partner->second.webs);
+			sendb.send(partner->first, partner->second.outbox, partner->second.webs);
 		} catch (const Error& err) {
-			slog.err("failed to send leave info from player ", pfd, " to player ", partner->first, ": ", err.what());
+			sendError("failed to send leave info from player ", pfd, " to player ", partner->first, ": ", err.what());
 			errPfds.insert(partner->first);
 		}
 		player.partner = partner->second.partner = INVALID_SOCKET;
 	}
+	enterLobby(pfd, player);
 
 	if (listCode != Code::version) {
 		try {
 			sendRoomList(pfd, player, listCode);
 		} catch (const Error& err) {
-			slog.err("failed to send room list to player ", pfd, ": ", err.what());
+			sendError("failed to send room list to player ", pfd, ": ", err.what());
 			errPfds.insert(pfd);
 		}
 	}
@@ -230,99 +842,370 @@ static void leaveRoom(nsint pfd, Player& player, Code listCode = Code::rlist) {
 }
 
 static void transferHost(nsint pfd, Player& player) {
-	umap<nsint, Player>::iterator partner = players.find(player.partner);
+	PlayerTable::iterator partner = players.find(player.partner);
 	rekeyRoom(pfd, partner->first);
 	try {
 		sendb.pushHead(Code::thost);
-		sendb.send(partner->first, partner->second.webs);
+		sendb.send(partner->first, partner->second.outbox, partner->second.webs);
 	} catch (const Error& err) {
-		slog.err("failed to send host info from player ", pfd, " to player ", partner->first, ": ", err.what());
+		sendError("failed to send host info from player ", pfd, " to player ", partner->first, ": ", err.what());
 		throw PlayerError{ pfd, partner->first };	// host will have already changed its UI, so kick both
 	}
 }
 
-static void globalMessage(uint8* data, nsint pfd, Player& player) {
+static void globalMessage(const uint8* data, nsint pfd) {
+	vector<Frame> frames = { Frame(data, readSize(data)) };
+	shareLobby(frames);
+
 	uset<nsint> errPfds;
-	for (auto& [fd, pl] : players)
-		if (fd != pfd && pl.partner == INVALID_SOCKET && !rooms.count(fd)) {
-			try {
-				player.recvb.redirect(fd, data, pl.webs);
-			} catch (const Error& err) {
-				errPfds.insert(fd);
-				slog.err("failed to send global message to player ", fd, ": ", err.what());
-			}
-		}
-	if (!errPfds.empty())
+	if (sendLobby(frames, errPfds, pfd); !errPfds.empty())
 		throw PlayerError(std::move(errPfds));
 }
 
 static void redirectData(uint8* data, nsint pfd, Player& player) {
 	if (Code(data[0]) < Code::hello || Code(data[0]) > Code::message) {
-		slog.err("invalid net code ", uint(data[0]), " from player ", pfd, " of size ", read16(data + 1));
+		slog.err("invalid net code ", uint(data[0]), " from player ", pfd, " of size ", readSize(data));
 		throw PlayerError{ pfd };
 	}
-	umap<nsint, Player>::iterator partner = players.find(player.partner);
+	PlayerTable::iterator partner = players.find(player.partner);
 	if (partner == players.end()) {
-		slog.err("data with code ", uint(data[0]), " from player ", pfd, " of size ", read16(data + 1), " to invalid partner ", player.partner);
+		slog.err("data with code ", uint(data[0]), " from player ", pfd, " of size ", readSize(data), " to invalid partner ", player.partner);
+		throw PlayerError{ pfd };
+	}
+	if (!read16(data + 1) && !partner->second.wide) {	// an older client would take the zero size for a broken message
+		slog.err("wide data with code ", uint(data[0]), " from player ", pfd, " of size ", readSize(data), " to player ", partner->first, " whose version can't read it");
 		throw PlayerError{ pfd };
 	}
 
 	try {
-		player.recvb.redirect(partner->first, data, partner->second.webs);
+		player.recvb.redirect(partner->first, partner->second.outbox, data, partner->second.webs);
 	} catch (const Error& err) {
-		slog.err("failed to send data with code ", uint(data[0]), " of size ", read16(data + 1), " from player ", pfd, " to player ", partner->first, ": ", err.what());
+		sendError("failed to send data with code ", uint(data[0]), " of size ", readSize(data), " from player ", pfd, " to player ", partner->first, ": ", err.what());
 		throw PlayerError{ partner->first };
 	}
 }
 
-static void connectPlayer(vector<pollfd>& pfds) {
-	if (players.size() >= maxPlayers) {
-		sendRejection(pfds[0].fd);
-		slog.out("rejected incoming connection");
-	} else try {
-		pfds.push_back({ acceptSocket(pfds[0].fd), POLLIN | POLLRDHUP, 0 });
-		players.emplace(pfds.back().fd, Player());
-		slog.out("player ", pfds.back().fd, " connected");
+static bool relayRun(nsint pfd, Player& player) {	// returns false if the messages have to go through the regular handling
+	PlayerTable::iterator partner = players.find(player.partner);
+	if (partner == players.end() || partner->second.webs)
+		return false;
+	uint len;
+	uint8* run = player.recvb.recvRun(len, Code::hello, Code::message);	// the same codes that redirectData allows
+	if (!run)
+		return false;
+
+	for (uint pos = 0; pos < len; pos += read16(run + pos + 1))	// a run has no wide messages
+		shard->counters.message(run[pos], read16(run + pos + 1));
+	try {
+		partner->second.outbox.write(partner->first, run, len);
 	} catch (const Error& err) {
-		slog.err(err.what());
+		player.recvb.clearRun(len);
+		sendError("failed to relay ", len, " bytes from player ", pfd, " to player ", partner->first, ": ", err.what());
+		throw PlayerError{ partner->first };
 	}
+	player.recvb.clearRun(len);
+	return true;
 }
 
-static void disconnectPlayers(uint& icur, vector<pollfd>& pfds, const uset<nsint>& dfds) {
-	for (nsint fd : dfds) {
-		vector<pollfd>::iterator pit = std::find_if(pfds.begin() + 1, pfds.end(), [fd](const pollfd& it) -> bool { return it.fd == fd; });
-		if (pit <= pfds.begin() + icur)
-			--icur;
+static void countPlayer(const Player& player, int64 num) {	// only for players that passed the version check
+	bump(player.webs ? shard->counters.wsPlayers : shard->counters.rawPlayers, num);
+}
+
+static PlayerTable::iterator addPlayer(nsint fd, Player&& player) {
+	try {
+		poller->add(fd, true);
+	} catch (const Error&) {
+		closeSocketV(fd);
+		--playerTotal;
+		throw;
+	}
+	if (player.outbox.setBacklog(&backlog); !player.outbox.empty())
+		backlog.push_back(fd);
+	if (player.cproc == cprocValidate) {
+		player.active = loopTime;
+		player.timer = timers->add(fd, loopTime + handshakeTimeout);
+	} else
+		player.timer = timers->add(fd, loopTime);	// let the checks catch up after moving shards
+	++shard->playerCount;
+	PlayerTable::iterator it = players.emplace(fd, std::move(player)).first;
+	if (it->second.cproc != cprocValidate)	// a moved player stays in the lobby until its join request succeeds
+		enterLobby(it->first, it->second);
+	return it;
+}
 
-		if (umap<nsint, Player>::iterator player = players.find(fd); player != players.end()) {
-			if (player->second.partner != INVALID_SOCKET || rooms.count(player->first))
-				leaveRoom(player->first, player->second, Code::version);
+static Player newPlayer() {
+	Player player;
+	player.outbox.setLimit(sendLimit);
+	player.outbox.setDeferred(poller->transfers());	// the poller submits the sends at the end of the iteration
+	return player;
+}
+
+static void connectPlayers() {
+	for (uint i = 0; i < acceptBudget; ++i) {
+		nsint fd;
+		try {
+			if (fd = poller->accept(server); fd == INVALID_SOCKET)
+				break;
+		} catch (const Error& err) {
+			slog.err(err.what());
+			break;
+		}
+		if (acceptLast = std::chrono::steady_clock::now(); !acceptCount && !rejectCount)
+			acceptStart = acceptLast;
+
+		if (playerTotal >= maxPlayers) {
+			rejectSocket(fd);
+			++rejectCount;
+			bump(shard->counters.rejected);
+			continue;
+		}
+		++playerTotal;
+		++acceptCount;
+		bump(shard->counters.accepted);
+		if (heartbeat)
+			keepaliveSocket(fd, uint(heartbeat / 1000000));
+		Shard* dst = shard;	// hand the player to the least busy shard
+		for (const uptr<Shard>& it : shards)
+			if (it->playerCount < dst->playerCount)
+				dst = it.get();
+
+		if (dst == shard) {
+			addPlayer(fd, newPlayer());
+			slog.out("player ", fd, " connected");
+		} else
+			dst->post(Mail(Mail::Type::connect, fd));
+	}
+}
+
+static void reportAccepts() {
+	if (std::chrono::steady_clock::now() - acceptStart < acceptReportInterval)
+		return;
+	std::chrono::duration<double, std::milli> time = acceptLast - acceptStart;
+	slog.out("accepted ", acceptCount, " and rejected ", rejectCount, " connections within ", uint(time.count()), "ms (", uint(double(acceptCount + rejectCount) * 1000.0 / std::max(time.count(), 1.0)), "/s)");
+	acceptCount = rejectCount = 0;
+}
+
+static void disconnectPlayers(const uset<nsint>& dfds) {
+	uset<nsint> failed;	// players that couldn't be told about a departure
+	for (nsint fd : dfds) {
+		if (PlayerTable::iterator player = players.find(fd); player != players.end()) {
+			if (player->second.partner != INVALID_SOCKET || rooms.count(player->first)) {
+				try {
+					leaveRoom(player->first, player->second, Code::version);
+				} catch (const PlayerError& err) {
+					failed.insert(err.pfds.begin(), err.pfds.end());
+				}
+			}
+			if (player->second.dropped)
+				slog.out("dropped ", player->second.dropped, " lobby messages for player ", fd);
+			if (player->second.cproc != cprocValidate)
+				countPlayer(player->second, -1);
+			if (player->second.timer != TimerWheel::none)
+				timers->cancel(player->second.timer);
+			exitLobby(player->second);
 			players.erase(player);
+			--shard->playerCount;
+			--playerTotal;
 		}
+		lobbyErrors.erase(fd);
+		poller->del(fd);
 		closeSocketV(fd);
-		if (pit != pfds.end())
-			pfds.erase(pit);
 		slog.out("player ", fd, " disconnected");
 	}
+
+	for (uset<nsint>::iterator it = failed.begin(); it != failed.end();)
+		it = players.count(*it) ? std::next(it) : failed.erase(it);
+	if (!failed.empty())
+		disconnectPlayers(failed);
+}
+
+static void departPlayers() {
+	for (auto& [sid, msg] : departures)
+		if (PlayerTable::iterator it = players.find(msg.fd); it != players.end() && it->second.cproc == cprocDepart) {
+			poller->release(it->first, it->second.recvb, it->second.outbox);
+			it->second.cproc = cprocPlayer;
+			it->second.waitOut = false;
+			countPlayer(it->second, -1);
+			exitLobby(it->second);
+			if (it->second.timer != TimerWheel::none) {
+				timers->cancel(it->second.timer);
+				it->second.timer = TimerWheel::none;
+			}
+			msg.player = std::move(it->second);
+			players.erase(it);
+			--shard->playerCount;
+			shards[sid]->post(std::move(msg));
+		}
+	departures.clear();
+}
+
+static uint64 checkPlayer(nsint fd, Player& player) {	// returns when to check again, UINT64_MAX for never or 0 to disconnect
+	if (player.cproc == cprocValidate) {
+		slog.out("player ", fd, " didn't pass the version check in time");
+		return 0;
+	}
+
+	uint64 next = UINT64_MAX;
+	if (lobbyTimeout && player.lobbyId != UINT_MAX) {
+		if (loopTime - player.active >= lobbyTimeout) {
+			slog.out("player ", fd, " was idle in the lobby for too long");
+			return 0;
+		}
+		next = player.active + lobbyTimeout;
+	}
+	if (heartbeat) {
+		if (!player.webs) {	// raw clients don't know pings, so keepalive probes and the kernel's estimate stand in
+			player.rtt = socketRtt(fd);
+			next = std::min(next, loopTime + heartbeat);
+		} else if (player.pingWait && loopTime - player.pingTime >= heartbeat) {
+			slog.out("player ", fd, " didn't answer a ping in time");
+			return 0;
+		} else {
+			if (!player.pingWait && loopTime - player.pingTime >= heartbeat) {
+				try {
+					player.outbox.write(fd, wsPing, sizeof(wsPing));
+				} catch (const Error& err) {
+					sendError("failed to send ping to player ", fd, ": ", err.what());
+					return 0;
+				}
+				player.pingTime = loopTime;
+				player.pingWait = true;
+			}
+			next = std::min(next, player.pingTime + heartbeat);
+		}
+	}
+	return next;
+}
+
+static void expireTimers() {
+	uset<nsint> dfds;
+	for (nsint fd : timers->advance(loopTime)) {
+		Player& player = players.at(fd);
+		player.timer = TimerWheel::none;
+		if (uint64 next = checkPlayer(fd, player); !next) {
+			bump(shard->counters.timeouts);
+			dfds.insert(fd);
+		} else if (next != UINT64_MAX)
+			player.timer = timers->add(fd, next);
+	}
+	if (!dfds.empty())
+		disconnectPlayers(dfds);
+}
+
+static void flushOutbox(const Poller::Ready& ev, Player& player) {
+	try {
+		if (poller->sent(ev, player.outbox))
+			player.waitOut = false;
+	} catch (const Error& err) {
+		sendError("failed to flush data to player ", ev.fd, ": ", err.what());
+		throw PlayerError{ ev.fd };
+	}
+}
+
+static void watchBacklog() {
+	for (nsint fd : backlog)
+		if (PlayerTable::iterator it = players.find(fd); it != players.end() && !it->second.outbox.empty() && !it->second.waitOut) {
+			try {
+				poller->send(fd, it->second.outbox);
+				it->second.waitOut = true;
+			} catch (const Error& err) {
+				slog.err(err.what());
+				disconnectPlayers({ fd });
+			}
+		}
+	backlog.clear();
+}
+
+static void receiveMail() {
+	vector<nsint> resumed;	// restored players whose received data is handled once their partners are there too
+	for (Mail& msg : shard->takeMail()) {
+		try {
+			switch (msg.type) {
+			case Mail::Type::connect:
+				addPlayer(msg.fd, newPlayer());
+				slog.out("player ", msg.fd, " connected");
+				break;
+			case Mail::Type::join: {
+				PlayerTable::iterator it = addPlayer(msg.fd, std::move(*msg.player));
+				countPlayer(it->second, 1);
+				joinRoom(msg.name, it->first, it->second);
+				while (it->second.cproc(it->first, it->second));	// handle what was received after the join request
+				break; }
+			case Mail::Type::broadcast: {
+				uset<nsint> errPfds;
+				if (sendLobby(msg.frames, errPfds, INVALID_SOCKET, msg.legacy); !errPfds.empty())
+					throw PlayerError(std::move(errPfds));
+				break; }
+			case Mail::Type::restore: {
+				PlayerTable::iterator it = addPlayer(msg.fd, std::move(*msg.player));
+				if (it->second.cproc != cprocValidate)
+					countPlayer(it->second, 1);
+				if (!msg.name.empty()) {
+					roomHosts.emplace(rooms.emplace(it->first, std::move(msg.name)).first->second, it->first);
+					exitLobby(it->second);
+					roomsChanged = true;
+				} else if (it->second.partner != INVALID_SOCKET) {	// the host has been restored before
+					if (PlayerTable::iterator host = players.find(it->second.partner); host != players.end()) {
+						host->second.partner = it->first;
+						exitLobby(it->second);
+					} else
+						throw PlayerError{ it->first };
+				}
+				resumed.push_back(it->first);
+			} }
+		} catch (const PlayerError& err) {
+			disconnectPlayers(err.pfds);
+		} catch (const Error& err) {
+			slog.err(err.what());
+		}
+	}
+
+	for (nsint fd : resumed)
+		if (PlayerTable::iterator it = players.find(fd); it != players.end()) {
+			try {
+				while (it->second.cproc(it->first, it->second));
+			} catch (const PlayerError& err) {
+				disconnectPlayers(err.pfds);
+			}
+		}
+}
+
+static void flushLast(nsint fd, Player& player) {	// tries to get a reply out without blocking right before the player gets disconnected
+	try {
+		if (poller->transfers()) {	// a deferred outbox would only be sent at the end of the iteration
+			poller->release(fd, player.recvb, player.outbox);
+			player.outbox.setDeferred(false);
+		}
+		player.outbox.flush(fd);
+	} catch (const Error&) {}
 }
 
 bool cprocValidate(nsint pfd, Player& player) {
 	try {
-		switch (player.recvb.recvConn(pfd, player.webs)) {
+		uint vid = 0;
+		switch (player.recvb.recvConn(pfd, player.webs, &player.outbox, &vid)) {
 		case Buffer::Init::wait:
 			return false;
 		case Buffer::Init::connect:
+			player.paged = vid < pagedVersions;
+			player.wide = vid < wideVersions;
 			try {
 				sendRoomList(pfd, player);
 			} catch (const Error& err) {
 				sendb.clear();
-				slog.err("failed to send room list to player ", pfd, ": ", err.what());
+				sendError("failed to send room list to player ", pfd, ": ", err.what());
 				throw PlayerError{ pfd };
 			}
 			player.cproc = cprocPlayer;
+			enterLobby(pfd, player);
+			player.pingTime = loopTime;
+			timers->cancel(player.timer);	// swap the handshake deadline for the regular checks
+			player.timer = timers->add(pfd, loopTime);
+			countPlayer(player, 1);
 			break;
 		case Buffer::Init::version:
-			sendVersion(pfd, player.webs);
+			sendVersion(pfd, player.outbox, player.webs);
+			flushLast(pfd, player);
 		case Buffer::Init::error:
 			throw PlayerError{ pfd };
 		}
@@ -333,21 +1216,29 @@ bool cprocValidate(nsint pfd, Player& player) {
 }
 
 bool cprocPlayer(nsint pfd, Player& player) {
+	if (relayRuns && !player.webs && player.partner != INVALID_SOCKET && relayRun(pfd, player))
+		return true;
+
 	uint8* data;
 	try {
-		if (data = player.recvb.recv(pfd, player.webs); !data)
+		if (data = player.recvb.recv(pfd, player.webs, &player.outbox); !data)
 			return false;
 	} catch (const Error&) {
 		throw PlayerError{ pfd };
 	}
+	shard->counters.message(data[0], readSize(data));
 
 	try {
+		if (!read16(data + 1) && (!player.wide || Code(data[0]) < Code::hello || Code(data[0]) > Code::message)) {	// only match data can outgrow the regular head
+			slog.err("wide data with code ", uint(data[0]), " from player ", pfd, " of size ", readSize(data));
+			throw PlayerError{ pfd };
+		}
 		switch (Code(data[0])) {
 		case Code::rnew:
 			createRoom(data + dataHeadSize, pfd, player);
 			break;
 		case Code::glmessage:
-			globalMessage(data, pfd, player);
+			globalMessage(data, pfd);
 			break;
 		case Code::join:
 			joinRoom(data + dataHeadSize, pfd, player);
@@ -361,6 +1252,9 @@ bool cprocPlayer(nsint pfd, Player& player) {
 		case Code::kick:
 			leaveRoom(player.partner, players.at(player.partner), Code::kick);
 			break;
+		case Code::rpage:
+			requestRoomPage(data, pfd, player);
+			break;
 		default:
 			redirectData(data, pfd, player);
 		}
@@ -369,7 +1263,11 @@ bool cprocPlayer(nsint pfd, Player& player) {
 		throw;
 	}
 	player.recvb.clearCur(player.webs);
-	return true;
+	return player.cproc == cprocPlayer;
+}
+
+bool cprocDepart(nsint, Player&) {	// the rest of the data will be handled by the player's new shard
+	return false;
 }
 
 #ifndef SERVICE
@@ -406,21 +1304,44 @@ static void checkInput() {
 #endif
 	switch (ch) {
 	case 'P': {
-		vector<array<string, 2>> table(players.size() + 1);
+		vector<array<string, 3>> table(players.size() + 1);
 		uint i = 1;
 		for (auto& [pfd, player] : players)
-			table[i++] = { toStr(pfd), player.partner != INVALID_SOCKET ? toStr(player.partner) : string() };
-		printTable(table, "Players:", { "SOCKET", "PARTNER" });
+			table[i++] = { toStr(pfd), player.partner != INVALID_SOCKET ? toStr(player.partner) : string(), player.rtt ? toStr(double(player.rtt) / 1000.0) : string() };
+		printTable(table, "Players:", { "SOCKET", "PARTNER", "RTT (ms)" });
+		if (shards.size() > 1) {
+			std::cout << "Players per shard:";
+			for (const uptr<Shard>& it : shards)
+				std::cout << ' ' << it->playerCount;
+			std::cout << std::endl;
+		}
 		break; }
 	case 'R': {
-		vector<array<string, 3>> table(rooms.size() + 1);
-		uint i = 1;
+		vector<array<string, 3>> table(1);
 		for (auto& [host, name] : rooms) {
 			Player& player = players.at(host);
-			table[i++] = { name, toStr(host), player.partner != INVALID_SOCKET ? toStr(player.partner) : string() };
+			table.push_back({ name, toStr(host), player.partner != INVALID_SOCKET ? toStr(player.partner) : string() });
 		}
+		ListingReader listing;
+		for (const uptr<Shard>& it : shards)
+			if (it.get() != shard)
+				for (const RoomListing& room : listing(*it))
+					table.push_back({ room.name, toStr(room.host), room.guest != INVALID_SOCKET ? toStr(room.guest) : string() });
 		printTable(table, "Rooms:", { "NAME", "HOST", "GUEST" });
 		break; }
+	case 'M': {
+		vector<PoolStats> stats = poolStats();
+		vector<array<string, 4>> table(stats.size() + 1);
+		uint64 reserved = 0, used = 0;
+		for (sizet i = 0; i < stats.size(); ++i) {
+			const PoolStats& it = stats[i];
+			table[i+1] = { it.size ? toStr(it.size) : ">" + toStr(poolBlockMax), toStr(it.slabs), toStr(it.blocks), toStr(it.used) };
+			reserved += uint64(it.size) * it.blocks;
+			used += uint64(it.size) * it.used;
+		}
+		printTable(table, "Buffer pool:", { "SIZE", "SLABS", "BLOCKS", "USED" });
+		std::cout << "Pooled bytes: " << used << " used of " << reserved << std::endl;
+		break; }
 	case 'Q':
 		running = false;
 		break;
@@ -430,49 +1351,538 @@ static void checkInput() {
 }
 #endif
 
-static void eventExit(int) {
+// HANDOFF
+
+#ifndef _WIN32
+static void acceptHandoff() {	// stops the loops if a new process asks to take over
+	nsint fd;
+	try {
+		if (fd = acceptSocketNow(handoffServer); fd == INVALID_SOCKET)
+			return;
+	} catch (const Error& err) {
+		slog.err(err.what());
+		return;
+	}
+
+	vector<nsint> fds;
+	try {
+		noblockSocket(fd, false);
+		timeoutSocket(fd, 1);	// a stray connection mustn't hold up the loop for long
+		vector<uint8> req = recvHandoff(fd, fds);
+		if (!fds.empty() || req.size() != sizeof(handoffMagic) + sizeof(handoffFormat) || read32(req.data()) != handoffMagic)
+			throw Error(msgHandoffFail);
+		if (uint16 format = read16(&req[sizeof(handoffMagic)]); format != handoffFormat) {
+			slog.err("refused handoff to a process with state format ", format, " instead of ", handoffFormat);
+			closeSocketV(fd);
+			return;
+		}
+	} catch (const Error& err) {
+		slog.err(err.what());
+		for (nsint it : fds)
+			closeSocketV(it);
+		closeSocketV(fd);
+		return;
+	}
+	timeoutSocket(fd, handoffTimeout);
+	handoffSocket = fd;
 	running = false;
+	slog.out("handing off to a new process");
 }
 
-static bool exec(vector<pollfd>& pfds) {
-	if (int rcp = poll(pfds.data(), ulong(pfds.size()), checkTimeout)) {
-		if (rcp < 0 || (pfds[0].revents & polleventsDisconnect)) {
-			slog.err(msgPollFail);
-			return running = false;
+static void savePlayers() {	// moves the players to the shard instead of closing them
+	if (shard->id == 0) {	// the poller may have accepted connections that haven't been taken yet
+		Buffer recvb;
+		Outbox outbox;
+		poller->release(server, recvb, outbox);
+		try {
+			for (nsint fd; (fd = poller->accept(server)) != INVALID_SOCKET;) {
+				if (heartbeat)
+					keepaliveSocket(fd, uint(heartbeat / 1000000));
+				shard->saved.emplace_back(fd, Player());
+			}
+		} catch (const Error& err) {
+			slog.err(err.what());
 		}
+	}
 
-		if (pfds[0].revents & POLLIN)
-			connectPlayer(pfds);
-		for (uint i = 1; i < pfds.size(); ++i) {
-			try {
-				if (pfds[i].revents & POLLIN) {
-					Player& player = players.at(pfds[i].fd);
-					bool fin = player.recvb.recvData(pfds[i].fd);
-					while (player.cproc(pfds[i].fd, player));
-					if (fin)
-						throw PlayerError{ pfds[i].fd };
-				} else if (pfds[i].revents & polleventsDisconnect)
-					throw PlayerError{ pfds[i].fd };
-			} catch (const PlayerError& err) {
-				disconnectPlayers(i, pfds, err.pfds);
-			} catch (...) {
-				slog.err("unexpected error during player ", pfds[i].fd, " iteration");
-				disconnectPlayers(i, pfds, { pfds[i].fd });
+	for (auto& [pfd, player] : players) {
+		poller->release(pfd, player.recvb, player.outbox);
+		player.outbox.setBacklog(nullptr);
+		bool inLobby = player.lobbyId != UINT_MAX;
+		umap<nsint, string>::iterator room = rooms.find(pfd);
+		shard->saved.emplace_back(pfd, std::move(player), room != rooms.end() ? std::move(room->second) : string(), string(), inLobby);
+	}
+	roomHosts.clear();
+	rooms.clear();
+	players.clear();
+	lobby.clear();
+}
+
+static void saveRecord(Buffer& data, Saved& it) {
+	uint rlen;
+	const uint8* rdat = it.player.recvb.recvPending(rlen);
+	data.push(uint32(it.fd));
+	data.push(uint32(it.player.partner));
+#ifdef DEFLATE
+	const Deflate* zip = it.player.outbox.getDeflate();
+#else
+	constexpr void* zip = nullptr;
+#endif
+	data.push(uint8((it.player.cproc != cprocValidate ? savedValid : 0) | (it.player.webs ? savedWebs : 0) | (it.player.paged ? savedPaged : 0) | (it.player.wide ? savedWide : 0) | (zip ? savedDeflate : 0)));
+#ifdef DEFLATE
+	if (zip) {	// the client's compressor may refer back to earlier messages, so the window has to come along
+		string window = zip->getWindow();
+		data.push(zip->getMode().clientBits);
+		data.push(uint8((zip->getMode().serverReset ? savedServerReset : 0) | (zip->getMode().clientReset ? savedClientReset : 0)));
+		data.push(uint16(window.length()));
+		data.push(window);
+	}
+#endif
+	data.push(uint8(it.room.length()));
+	data.push(it.room);
+	data.push(uint8(it.join.length()));
+	data.push(it.join);
+	data.push(uint32(rlen));
+	data.push(std::string_view(reinterpret_cast<const char*>(rdat), rlen));
+	data.push(uint32(it.player.outbox.getSize()));
+	it.player.outbox.gather(UINT_MAX, [&data](uint, const uint8* chunk, uint len, const sptr<uint8[]>&) {
+		data.push(std::string_view(reinterpret_cast<const char*>(chunk), len));
+	});
+}
+
+static void handOff() {	// passes the listeners, players and rooms to the process that's taking over
+	savePlayers();
+	vector<Saved> saved;
+	for (uptr<Shard>& sh : shards) {
+		for (Mail& msg : sh->takeMail())	// what the loops didn't get to anymore
+			switch (msg.type) {
+			case Mail::Type::connect:
+				sh->saved.emplace_back(msg.fd, Player());
+				break;
+			case Mail::Type::join:
+				sh->saved.emplace_back(msg.fd, std::move(*msg.player), string(), std::move(msg.name));
+				break;
+			case Mail::Type::broadcast:
+				for (Saved& it : sh->saved)
+					if (it.lobby) {
+						try {
+							it.player.outbox.write(it.fd, it.player.paged || msg.legacy.empty() ? msg.frames : msg.legacy, it.player.webs);
+						} catch (const Error& err) {
+							sendError("failed to send room changes to lobby player ", it.fd, ": ", err.what());
+						}
+					}
+				break;
+			case Mail::Type::restore:
+				sh->saved.emplace_back(msg.fd, std::move(*msg.player), std::move(msg.name));
 			}
+		std::move(sh->saved.begin(), sh->saved.end(), std::back_inserter(saved));
+		sh->saved.clear();
+	}
+
+	uint rcnt = 0;
+	Buffer data;
+	data.push(handoffMagic);
+	data.push(handoffFormat);
+	data.push(uint8(metricsServer != INVALID_SOCKET));
+	data.push(uint32(saved.size()));
+	vector<nsint> fds = { server };
+	if (metricsServer != INVALID_SOCKET)
+		fds.push_back(metricsServer);
+	for (Saved& it : saved) {
+		saveRecord(data, it);
+		fds.push_back(it.fd);
+		rcnt += !it.room.empty();
+	}
+	try {
+		sendHandoff(handoffSocket, data.getData(), data.getDlim(), fds);
+		slog.out("handed over ", saved.size(), " players and ", rcnt, " rooms");
+	} catch (const Error& err) {
+		slog.err(err.what());
+	}
+	for (const Saved& it : saved)
+		closeSocketV(it.fd);
+}
+
+static vector<uint8> takeOver(vector<nsint>& fds) {	// gets the sockets and the state of the process that's listening at handoffPath or nothing if there is none
+	nsint fd = connectLocal(handoffPath);
+	if (fd == INVALID_SOCKET)
+		return {};
+
+	vector<uint8> data;
+	try {
+		timeoutSocket(fd, handoffTimeout);
+		uint8 req[sizeof(handoffMagic) + sizeof(handoffFormat)];
+		write16(write32(req, handoffMagic), handoffFormat);
+		sendHandoff(fd, req, sizeof(req), {});
+		if (data = recvHandoff(fd, fds); data.size() < handoffHeadSize + sizeof(uint32) || read32(data.data()) != handoffMagic || read16(&data[sizeof(handoffMagic)]) != handoffFormat || fds.size() < (data[handoffHeadSize-1] ? 2u : 1u))
+			throw Error(msgHandoffFail);
+	} catch (const Error&) {
+		for (nsint it : fds)
+			closeSocketV(it);
+		closeSocketV(fd);
+		throw Error("Failed to take over from the running server");
+	}
+	closeSocketV(fd);
+
+	server = fds[0];
+	if (data[handoffHeadSize-1])
+		metricsServer = fds[1];
+	fds.erase(fds.begin(), fds.begin() + (data[handoffHeadSize-1] ? 2 : 1));
+	data.erase(data.begin(), data.begin() + handoffHeadSize);
+	return data;
+}
+
+static void restorePlayers(const vector<uint8>& data, const vector<nsint>& fds) {	// spreads the players of the previous process over the shards
+	const uint8* pos = data.data();
+	const uint8* end = pos + data.size();
+	auto take = [&pos, end](uint len) -> const uint8* {
+		if (uint(end - pos) < len)
+			throw Error(msgHandoffFail);
+		const uint8* dat = pos;
+		pos += len;
+		return dat;
+	};
+	auto text = [&take]() -> string {
+		uint8 len = *take(sizeof(uint8));
+		return string(reinterpret_cast<const char*>(take(len)), len);
+	};
+
+	if (read32(take(sizeof(uint32))) != fds.size())
+		throw Error(msgHandoffFail);
+	vector<Saved> saved;
+	umap<nsint, nsint> socks;	// old socket, new socket
+	uint64 now = steadyTime();
+	for (nsint fd : fds) {
+		Saved& it = saved.emplace_back(fd, newPlayer());
+		socks.emplace(nsint(int32(read32(take(sizeof(uint32))))), fd);
+		it.player.partner = nsint(int32(read32(take(sizeof(uint32)))));
+		uint8 flags = *take(sizeof(uint8));
+		it.player.cproc = flags & savedValid ? cprocPlayer : cprocValidate;
+		it.player.webs = flags & savedWebs;
+		it.player.paged = flags & savedPaged;
+		it.player.wide = flags & savedWide;
+#ifdef DEFLATE
+		if (flags & savedDeflate) {
+			Deflate::Mode how;
+			how.clientBits = *take(sizeof(uint8));
+			uint8 resets = *take(sizeof(uint8));
+			how.serverReset = resets & savedServerReset;
+			how.clientReset = resets & savedClientReset;
+			uptr<Deflate> zip = std::make_unique<Deflate>(how);
+			uint16 wlen = read16(take(sizeof(uint16)));
+			zip->setWindow(take(wlen), wlen);
+			it.player.outbox.setDeflate(std::move(zip));
+		}
+#endif
+		it.player.active = it.player.pingTime = now;
+		it.room = text();
+		it.join = text();
+		uint len = read32(take(sizeof(uint32)));
+		it.player.recvb.recvData(take(len), len);
+		if (len = read32(take(sizeof(uint32))); len) {
+			it.player.outbox.setLimit(UINT_MAX);	// the data had been accepted under the old limit
+			it.player.outbox.setDeferred(true);		// the poller sends it once the player is added
+			it.player.outbox.write(fd, take(len), len);
+			it.player.outbox.setLimit(sendLimit);
+			it.player.outbox.setDeferred(poller->transfers());
+		}
+	}
+
+	uint rcnt = 0;
+	vector<uint> loads(shards.size(), 0);
+	umap<nsint, uint> hosts;	// host socket, shard id
+	auto post = [&loads](uint sid, Saved& it, Mail::Type type, string&& name) {
+		Mail msg(type, it.fd);
+		msg.player = std::move(it.player);
+		msg.name = std::move(name);
+		shards[sid]->post(std::move(msg));
+		++loads[sid];
+	};
+	for (Saved& it : saved)	// the hosts need to be there before their guests
+		if (!it.room.empty()) {
+			uint sid = uint(std::min_element(loads.begin(), loads.end()) - loads.begin());
+			if (directory.claim(it.room, sid, UINT_MAX) != CncrnewCode::ok)
+				it.room.clear();
+			else {
+				hosts.emplace(it.fd, sid);
+				it.player.partner = INVALID_SOCKET;
+				post(sid, it, Mail::Type::restore, std::move(it.room));
+				it.fd = INVALID_SOCKET;
+				++loads[sid];	// for the guest
+				++rcnt;
+			}
+		}
+	for (Saved& it : saved) {
+		if (it.fd == INVALID_SOCKET)
+			continue;
+		if (it.player.partner != INVALID_SOCKET) {
+			umap<nsint, nsint>::iterator partner = socks.find(it.player.partner);
+			it.player.partner = partner != socks.end() ? partner->second : INVALID_SOCKET;
+		}
+
+		if (!it.join.empty()) {
+			uint sid = directory.find(it.join);
+			post(sid < shards.size() ? sid : 0, it, Mail::Type::join, std::move(it.join));	// the join request gets rejected if the room is gone
+		} else if (umap<nsint, uint>::iterator host = hosts.find(it.player.partner); host != hosts.end())
+			post(host->second, it, Mail::Type::restore, string());
+		else {
+			it.player.partner = INVALID_SOCKET;
+			post(uint(std::min_element(loads.begin(), loads.end()) - loads.begin()), it, Mail::Type::restore, string());
+		}
+	}
+	playerTotal += uint(saved.size());
+	slog.out("took over ", saved.size(), " players and ", rcnt, " rooms");
+
+	loopTime = steadyTime();
+	receiveMail();	// the main loop doesn't get woken up for its own mail if there's only one shard
+}
+#endif
+
+static void eventExit(int) {
+	running = false;
+}
+
+static bool exec() {
+	const vector<Poller::Ready>* ready;
+	try {
+		ready = &poller->wait(checkTimeout);
+	} catch (const Error& err) {
+		slog.err(err.what());
+		return running = false;
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	loopTime = uint64(std::chrono::duration_cast<std::chrono::microseconds>(start.time_since_epoch()).count());
+
+	uint8 sevents = 0;
+	for (const Poller::Ready& it : *ready) {
+		if (it.fd == INVALID_SOCKET || !it.events)	// dropped after its socket got closed
+			continue;
+		if (it.fd == server) {
+			sevents = it.events;
+			continue;
+		}
+		if (it.fd == shard->wake[0]) {
+			receiveMail();
+			continue;
+		}
+#ifndef _WIN32
+		if (it.fd == handoffServer) {
+			acceptHandoff();
+			continue;
+		}
+#endif
+
+		PlayerTable::iterator pit = players.find(it.fd);
+		if (pit == players.end())	// already disconnected during this iteration
+			continue;
+		try {
+			if (it.events & Poller::EV_OUT)
+				flushOutbox(it, pit->second);
+			if (it.events & Poller::EV_IN) {
+				bool fin = false;
+				if (it.data)
+					pit->second.recvb.recvData(*it.data, it.len);
+				else
+					fin = pit->second.recvb.recvData(it.fd);
+				pit->second.active = loopTime;
+				while (pit->second.cproc(it.fd, pit->second));
+				if (pit->second.recvb.takePong() && pit->second.pingWait) {
+					pit->second.rtt = uint(loopTime - pit->second.pingTime);
+					pit->second.pingWait = false;
+				}
+				if (fin)
+					throw PlayerError{ it.fd };
+			} else if (it.events & Poller::EV_DISCONNECT)
+				throw PlayerError{ it.fd };
+		} catch (const PlayerError& err) {
+			disconnectPlayers(err.pfds);
+		} catch (...) {
+			slog.err("unexpected error during player ", it.fd, " iteration");
+			disconnectPlayers({ it.fd });
 		}
 	}
+	expireTimers();
+	if (!roomEvents.empty())
+		flushRooms();
+	if (!lobbyErrors.empty()) {
+		uset<nsint> dfds;
+		dfds.swap(lobbyErrors);
+		disconnectPlayers(dfds);
+	}
+	if (!departures.empty())
+		departPlayers();
+	if (!backlog.empty())
+		watchBacklog();
+	if (roomsChanged && shards.size() > 1)
+		publishRooms();
+
+	if (sevents & Poller::EV_DISCONNECT) {	// accept after the players so that a reused socket can't get a stale event
+		slog.err(msgPollFail);
+		return running = false;
+	}
+	if (sevents & Poller::EV_IN)
+		connectPlayers();
+	if (shard->id == 0 && (acceptCount || rejectCount))
+		reportAccepts();
 #ifndef SERVICE
-	checkInput();
+	if (shard->id == 0)
+		checkInput();
 #endif
+	shard->counters.loop(uint64(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()));
 	return running;
 }
 
-static int cleanup(const vector<pollfd>& pfds, int rc) {
+static void closePlayers() {
+	for (auto& [pfd, player] : players) {
+		closeSocketV(pfd);
+		slog.out("socket ", pfd, " closed");
+	}
+	players.clear();
+	lobby.clear();
+	poller.reset();
+	timers.reset();
+}
+
+static void runShard(Shard* sh) {
+	shard = sh;
+	poller = std::move(sh->poller);
+	timers = std::make_unique<TimerWheel>(steadyTime());
+	try {
+		while (exec());
+	} catch (const std::runtime_error& err) {
+		slog.err("runtime error in shard ", sh->id, ": ", err.what());
+		running = false;
+	} catch (...) {
+		slog.err("unknown error in shard ", sh->id);
+		running = false;
+	}
+#ifndef _WIN32
+	if (handoffSocket != INVALID_SOCKET)
+		savePlayers();
+#endif
+	closePlayers();
+}
+
+static void answerMetrics(nsint fd) {
+	Metrics metrics;
+	metrics.family("thrones_connections", "gauge", "Open player connections.");
+	metrics.sample("thrones_connections", string(), uint64(playerTotal.load()));
+	metrics.family("thrones_connections_limit", "gauge", "Maximum number of player connections.");
+	metrics.sample("thrones_connections_limit", string(), uint64(maxPlayers));
+	metrics.family("thrones_rooms", "gauge", "Open rooms.");
+	metrics.sample("thrones_rooms", string(), uint64(directory.size()));
+
+	uint64 reserved = 0, used = 0;
+	for (const PoolStats& it : poolStats()) {
+		reserved += uint64(it.size) * it.blocks;
+		used += uint64(it.size) * it.used;
+	}
+	metrics.family("thrones_buffer_pool_bytes", "gauge", "Memory of the buffer pool's size classes.");
+	metrics.sample("thrones_buffer_pool_bytes", "state=\"reserved\"", reserved);
+	metrics.sample("thrones_buffer_pool_bytes", "state=\"used\"", used);
+
+	vector<const Counters*> counters(shards.size());
+	for (sizet i = 0; i < shards.size(); ++i)
+		counters[i] = &shards[i]->counters;
+	metrics.counters(counters);
+	metrics.answer(fd, running);
+}
+
+static void runMetrics() {	// scrapes are rare, so they're handled one at a time outside of the event loops
+	while (running) {
+		pollfd pfd = { metricsServer, POLLIN, 0 };
+		if (int rc = poll(&pfd, 1, checkTimeout); rc < 0 || (rc && (pfd.revents & polleventsDisconnect))) {
+			slog.err("metrics: ", msgPollFail);
+			break;
+		} else if (!rc)
+			continue;
+
+		try {
+			for (nsint fd; (fd = acceptSocketNow(metricsServer)) != INVALID_SOCKET;) {
+				noblockSocket(fd, false);
+				answerMetrics(fd);
+			}
+		} catch (const Error& err) {
+			slog.err("metrics: ", err.what());
+		}
+	}
+}
+
+static void createShards(uint cnt, bool uring) {
+	for (uint i = 0; i < cnt; ++i) {
+		Shard* sh = shards.emplace_back(std::make_unique<Shard>(i)).get();
+		string failure;
+		if (sh->poller = Poller::create(uring, &failure); !failure.empty() && !i)
+			slog.err("io_uring isn't available (", failure, ")");
+#ifndef _WIN32
+		if (cnt > 1) {
+			if (pipe(sh->wake))
+				throw Error("Failed to create pipe");
+			noblockSocket(sh->wake[0], true);
+			noblockSocket(sh->wake[1], true);
+			sh->poller->add(sh->wake[0], false);
+		}
+#endif
+	}
+	shard = shards[0].get();
+	poller = std::move(shard->poller);
+	timers = std::make_unique<TimerWheel>(steadyTime());
+	poller->listen(server);
+}
+
+static uint raiseFileLimit(uint threads) {	// returns the amount of players that the open file limit leaves room for
+#ifdef _WIN32
+	(void)threads;
+	return maxPlayersLimit;
+#else
+	rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim))
+		return maxPlayersLimit;
+	if (lim.rlim_cur < lim.rlim_max) {	// the soft limit is usually far below what's allowed
+		rlim_t cur = lim.rlim_cur;
+		if (lim.rlim_cur = lim.rlim_max; setrlimit(RLIMIT_NOFILE, &lim))
+			lim.rlim_cur = cur;
+	}
+	if (lim.rlim_cur == RLIM_INFINITY)
+		return maxPlayersLimit;
+	rlim_t reserve = reservedFiles + rlim_t(threads) * 3;	// poller and wake pipe
+	return uint(std::min(lim.rlim_cur > reserve ? lim.rlim_cur - reserve : 0, rlim_t(maxPlayersLimit)));
+#endif
+}
+
+static uint idleMemory() {	// estimate of what a player in the lobby costs in user space without any pending data
+	return PlayerTable::entryMemory + poolRound(Buffer::sizeStep) + TimerWheel::timerMemory + uint(sizeof(pair<nsint, Player*>)) + poller->socketMemory();
+}
+
+static int cleanup(int rc) {
+	running = false;
+	for (uptr<Shard>& it : shards)
+		if (it->thread.joinable())
+			it->thread.join();
+	if (metricsThread.joinable())
+		metricsThread.join();
+#ifndef _WIN32
+	if (handoffSocket != INVALID_SOCKET) {
+		handOff();
+		closeSocketV(handoffSocket);
+	}
+#endif
 	slog.out("exiting with code ", rc);
-	for (vector<pollfd>::const_reverse_iterator it = pfds.rbegin(); it != pfds.rend(); ++it) {
-		closeSocketV(it->fd);
-		slog.out("socket ", it->fd, " closed");
+	closePlayers();
+	if (server != INVALID_SOCKET) {
+		closeSocketV(server);
+		slog.out("socket ", server, " closed");
 	}
+	if (metricsServer != INVALID_SOCKET)
+		closeSocketV(metricsServer);
+#ifndef _WIN32
+	if (handoffServer != INVALID_SOCKET) {
+		closeSocketV(handoffServer);
+		if (handoffSocket == INVALID_SOCKET)	// otherwise the path may already belong to the next process
+			unlink(handoffPath);
+	}
+#endif
+	shards.clear();
 	slog.end();
 #ifdef _WIN32
 	WSACleanup();
@@ -492,17 +1902,47 @@ int main(int argc, char** argv) {
 	signal(SIGABRT, eventExit);
 	signal(SIGTERM, eventExit);
 
-	vector<pollfd> pfds = { { INVALID_SOCKET, POLLIN | POLLRDHUP, 0 } };	// first element is server
 	try {
-		Arguments args(argc, argv, { arg4, arg6, argVerbose }, { argPort, argMaxPlayers, argLog, argMaxLogs });
+		Arguments args(argc, argv, { arg4, arg6, argDropSlow, argRelayRuns, argUring, argNoContext, argVerbose }, { argPort, argMaxPlayers, argLog, argMaxLogs, argThreads, argSendLimit, argBacklog, argMetrics, argHeartbeat, argLobbyTimeout, argHandoff, argDeflate });
 		const char* maxLogs = args.getOpt(argMaxLogs);
 		slog.start(args.hasFlag(argVerbose), args.getOpt(argLog), maxLogs ? sstoul(maxLogs) : Log::defaultMaxLogfiles);
 
 		const char* port = args.getOpt(argPort);
 		if (!port)
 			port = defaultPort;
+		const char* queueLim = args.getOpt(argSendLimit);
+		sendLimit = queueLim ? uint(std::clamp(sstoul(queueLim), ulong(dataSizeLimit) + wsHeadMax, ulong(UINT_MAX))) : defaultSendLimit;
+		dropSlow = args.hasFlag(argDropSlow);
+		relayRuns = args.hasFlag(argRelayRuns);
+		const char* heartbeatTime = args.getOpt(argHeartbeat);
+		heartbeat = uint64(heartbeatTime ? std::min(sstoul(heartbeatTime), 86400ul) : defaultHeartbeat) * 1000000;
+		const char* lobbyTime = args.getOpt(argLobbyTimeout);
+		lobbyTimeout = uint64(lobbyTime ? std::min(sstoul(lobbyTime), 86400ul * 7) : defaultLobbyTimeout) * 1000000;
+		const char* deflateMin = args.getOpt(argDeflate);
+		uint deflateSize = deflateMin ? uint(std::min(sstoul(deflateMin), ulong(UINT_MAX))) : UINT_MAX;
+#ifdef DEFLATE
+		if (deflateMin)
+			Deflate::configure(deflateSize, args.hasFlag(argNoContext));
+#else
+		if (deflateMin) {
+			slog.err("ignoring -", argDeflate, " because this build doesn't support compression");
+			deflateMin = nullptr;
+		}
+#endif
+		const char* backlogLen = args.getOpt(argBacklog);
+		int listenBacklog = backlogLen ? int(std::clamp(sstoul(backlogLen), 1ul, ulong(INT_MAX))) : defaultListenBacklog;
+#ifdef _WIN32
+		uint threads = 1;	// there's no pipe to wake up a shard's loop
+#else
+		const char* threadCnt = args.getOpt(argThreads);
+		uint threads = threadCnt ? uint(std::clamp(sstoul(threadCnt), 1ul, ulong(maxThreadsLimit))) : 1;
+#endif
 		const char* playerLim = args.getOpt(argMaxPlayers);
 		maxPlayers = playerLim ? std::min(sstoul(playerLim), ulong(maxPlayersLimit)) : defaultMaxPlayers;
+		if (uint fileLim = raiseFileLimit(threads); maxPlayers > fileLim) {
+			slog.err("lowering the player limit from ", maxPlayers, " to ", fileLim, " because of the open file limit");
+			maxPlayers = fileLim;
+		}
 		int family = AF_UNSPEC;
 		if (args.hasFlag(arg4) && !args.hasFlag(arg6))
 			family = AF_INET;
@@ -516,24 +1956,56 @@ int main(int argc, char** argv) {
 #else
 		pid_t pid = getpid();
 #endif
-		pfds[0].fd = bindSocket(port, family);
-		slog.out(linend, "Thrones Server v", commonVersion, linend, "PID: ", pid, linend, "port: ", port, linend, "family: ", family == AF_INET ? "AF_INET" : family == AF_INET6 ? "AF_INET6" : "AF_UNSPEC", linend, "player limit: ", maxPlayers, linend, "room limit: ", maxRooms(), linend);
+		vector<uint8> handed;	// state of the previous process
+		vector<nsint> handedFds;
+#ifndef _WIN32
+		if (handoffPath = args.getOpt(argHandoff); handoffPath)
+			handed = takeOver(handedFds);	// the listeners are taken over as they are
+#endif
+		if (server == INVALID_SOCKET) {
+			server = bindSocket(port, family, listenBacklog);
+			if (noblockSocket(server, true))
+				throw Error(msgIoctlFail);
+		}
+		const char* metricsPort = args.getOpt(argMetrics);
+		if (metricsPort && metricsServer == INVALID_SOCKET) {
+			metricsServer = bindSocket(metricsPort, family);
+			if (noblockSocket(metricsServer, true))
+				throw Error(msgIoctlFail);
+		} else if (!metricsPort && metricsServer != INVALID_SOCKET)
+			closeSocket(metricsServer);
+		createShards(threads, args.hasFlag(argUring));
+#ifndef _WIN32
+		if (!handed.empty())
+			restorePlayers(handed, handedFds);
+		if (handoffPath) {
+			handoffServer = bindLocal(handoffPath);
+			if (noblockSocket(handoffServer, true))
+				throw Error(msgIoctlFail);
+			poller->add(handoffServer, false);
+		}
+#endif
+		for (uint i = 1; i < threads; ++i)
+			shards[i]->thread = std::thread(runShard, shards[i].get());
+		if (metricsServer != INVALID_SOCKET)
+			metricsThread = std::thread(runMetrics);
+		slog.out(linend, "Thrones Server v", commonVersion, linend, "PID: ", pid, linend, "port: ", port, linend, "family: ", family == AF_INET ? "AF_INET" : family == AF_INET6 ? "AF_INET6" : "AF_UNSPEC", linend, "player limit: ", maxPlayers, linend, "room limit: ", maxRooms(), linend, "memory per idle player: ~", idleMemory(), " bytes (plus the kernel's socket buffers)", linend, "listen backlog: ", listenBacklog, linend, "metrics port: ", metricsPort ? metricsPort : "none", linend, "handoff socket: ", handoffPath ? handoffPath : "none", handed.empty() ? "" : " (took over)", linend, "event loop: ", poller->name(), linend, "threads: ", threads, linend, "send queue limit: ", sendLimit, dropSlow ? " (drop lobby messages)" : " (disconnect)", linend, "raw relay: ", relayRuns ? "batched" : "per message", linend, "heartbeat: ", heartbeat ? toStr(heartbeat / 1000000) + 's' : "off", linend, "lobby timeout: ", lobbyTimeout ? toStr(lobbyTimeout / 1000000) + 's' : "off", linend, "compression: ", deflateMin ? "from " + toStr(deflateSize) + " bytes" + (args.hasFlag(argNoContext) ? " without context takeover" : "") : "off", linend);
 	} catch (const Error& err) {
 		slog.err(err.what());
-		return cleanup(pfds, EXIT_FAILURE);
+		return cleanup(EXIT_FAILURE);
 	}
 
 #if !defined(_WIN32) && !defined(SERVICE)
 	Terminal term;	// here to set and reset the terminal
 #endif
 	try {
-		while (exec(pfds));
+		while (exec());
 	} catch (const std::runtime_error& err) {
 		slog.err("runtime error: ", err.what());
-		return cleanup(pfds, EXIT_FAILURE);
+		return cleanup(EXIT_FAILURE);
 	} catch (...) {
 		slog.err("unknown error");
-		return cleanup(pfds, EXIT_FAILURE);
+		return cleanup(EXIT_FAILURE);
 	}
-	return cleanup(pfds, EXIT_SUCCESS);
+	return cleanup(EXIT_SUCCESS);
 }
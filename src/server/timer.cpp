@@ -0,0 +1,79 @@
+#include "timer.h"
+
+TimerWheel::TimerWheel(uint64 now) :
+	tick(now / tickLen)
+{
+	slots.fill(none);
+}
+
+uint TimerWheel::add(nsint fd, uint64 deadline) {
+	uint id;
+	if (!freeIds.empty()) {
+		id = freeIds.back();
+		freeIds.pop_back();
+	} else {
+		id = uint(nodes.size());
+		nodes.emplace_back();
+	}
+	nodes[id].expire = std::clamp((deadline + tickLen - 1) / tickLen, tick + 1, tick + maxDelay);	// round up to never expire early
+	nodes[id].fd = fd;
+	link(id);
+	++count;
+	return id;
+}
+
+void TimerWheel::cancel(uint id) {
+	unlink(id);
+	freeIds.push_back(id);
+	--count;
+}
+
+const vector<nsint>& TimerWheel::advance(uint64 now) {
+	due.clear();
+	for (uint64 target = now / tickLen; tick < target;) {
+		if (!count) {	// nothing to cascade or expire on the way
+			tick = target;
+			break;
+		}
+		++tick;
+		for (uint lvl = levelCount - 1; lvl; --lvl)	// move an upper slot's timers down once all levels below it have wrapped around
+			if (!(tick & ((uint64(1) << (slotBits * lvl)) - 1)))
+				cascade(lvl * slotCount + uint(tick >> (slotBits * lvl)) % slotCount);
+		for (uint& head = slots[uint(tick % slotCount)]; head != none;) {
+			due.push_back(nodes[head].fd);
+			cancel(head);
+		}
+	}
+	return due;
+}
+
+void TimerWheel::link(uint id) {
+	Node& node = nodes[id];
+	uint lvl = 0;	// the lowest level whose upper digits match the current tick
+	while (lvl < levelCount - 1 && node.expire >> (slotBits * (lvl + 1)) != tick >> (slotBits * (lvl + 1)))
+		++lvl;
+	node.slot = lvl * slotCount + uint(node.expire >> (slotBits * lvl)) % slotCount;
+	node.prev = none;
+	if (node.next = slots[node.slot]; node.next != none)
+		nodes[node.next].prev = id;
+	slots[node.slot] = id;
+}
+
+void TimerWheel::unlink(uint id) {
+	Node& node = nodes[id];
+	if (node.prev != none)
+		nodes[node.prev].next = node.next;
+	else
+		slots[node.slot] = node.next;
+	if (node.next != none)
+		nodes[node.next].prev = node.prev;
+}
+
+void TimerWheel::cascade(uint slot) {
+	uint id = slots[slot];
+	for (slots[slot] = none; id != none;) {
+		uint next = nodes[id].next;
+		link(id);
+		id = next;
+	}
+}
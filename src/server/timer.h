@@ -0,0 +1,49 @@
+#pragma once
+
+#include "server.h"
+
+// hierarchical timing wheel that schedules, cancels and expires a deadline per socket in constant time
+class TimerWheel {
+public:
+	static constexpr uint none = UINT_MAX;
+	static constexpr uint64 tickLen = 100000;	// resolution in microseconds
+
+private:
+	static constexpr uint slotBits = 6;
+	static constexpr uint slotCount = 1 << slotBits;
+	static constexpr uint levelCount = 4;
+	static constexpr uint64 maxDelay = uint64(slotCount - 1) << (slotBits * (levelCount - 1));	// in ticks, so that a slot of the top level can't be reached twice before a timer expires
+
+	struct Node {
+		uint64 expire;	// tick
+		uint prev, next;
+		uint slot;
+		nsint fd;
+	};
+
+	vector<Node> nodes;
+	vector<uint> freeIds;
+	array<uint, slotCount * levelCount> slots;	// first node of each slot's list
+	vector<nsint> due;
+	uint64 tick;
+	uint count = 0;
+
+public:
+	static constexpr uint timerMemory = sizeof(Node) + sizeof(uint);	// per timer including its entry in freeIds
+
+	TimerWheel(uint64 now);	// all times are in microseconds
+
+	uint add(nsint fd, uint64 deadline);	// returns the timer's id
+	void cancel(uint id);
+	const vector<nsint>& advance(uint64 now);	// removes and returns the sockets whose deadline has passed
+	uint size() const;
+
+private:
+	void link(uint id);
+	void unlink(uint id);
+	void cascade(uint slot);
+};
+
+inline uint TimerWheel::size() const {
+	return count;
+}
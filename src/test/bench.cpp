@@ -0,0 +1,57 @@
+#include "server/server.h"
+#include "utils/text.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+static void unmaskBytes(uint8* data, uint len, const uint8* mask) {	// the original byte by byte loop for comparison
+	for (uint i = 0; i < len; ++i)
+		data[i] ^= mask[i % sizeof(uint32)];
+}
+
+template <class F>
+static double measure(F unmask, vector<uint8>& data, uint len, uint reps) {
+	const uint8 mask[] = { 0x12, 0x34, 0x56, 0x78 };
+	steady_clock::time_point start = steady_clock::now();
+	for (uint i = 0; i < reps; ++i)
+		unmask(data.data(), len, mask);
+	return duration<double, std::nano>(steady_clock::now() - start).count() / (double(len) * reps);
+}
+
+static void benchUnmask() {
+	constexpr uint volume = 256 * 1024 * 1024;	// bytes to process per size
+	std::cout << "Unmask in ns per byte:" << linend << std::left << std::fixed << std::setprecision(4);
+	std::cout << std::setw(8) << "SIZE" << std::setw(10) << "BYTEWISE" << std::setw(10) << "VECTOR" << "SPEEDUP" << linend;
+	for (uint len : { 16u, 64u, 256u, 1024u, 4096u, 65536u }) {
+		vector<uint8> data(len, 0xAB);
+		uint reps = volume / len;
+		double bytes = measure(unmaskBytes, data, len, reps);
+		double simd = measure(Com::unmaskData, data, len, reps);
+		std::cout << std::setw(8) << len << std::setw(10) << bytes << std::setw(10) << simd << bytes / simd << linend;
+		if (data[0] != 0xAB)	// both ran an even amount of times, so the data should be back to where it started
+			std::cerr << "unmask mismatch" << std::endl;
+	}
+	std::cout << std::endl;
+}
+
+static void benchHandshake() {
+	constexpr uint reps = 1000000;
+	string key = "dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	sizet sum = 0;
+	steady_clock::time_point start = steady_clock::now();
+	for (uint i = 0; i < reps; ++i) {
+		key[i % 24] = char('A' + i % 26);
+		sum += Com::encodeBase64(Com::digestSha1(key)).length();
+	}
+	double time = duration<double, std::nano>(steady_clock::now() - start).count() / reps;
+	std::cout << "WebSocket accept key in ns: " << time << (sum == reps * 28 ? "" : " (bad length)") << linend << std::endl;
+}
+
+int main() {
+	benchUnmask();
+	benchHandshake();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,379 @@
+#include "server/poller.h"
+#include "utils/text.h"
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+using namespace Com;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+// CLIENT
+
+// one fake player whose partner is the other half of the room
+struct Client {
+	Buffer recvb;
+	Outbox outbox;
+	std::deque<steady_clock::time_point> sent;	// send times of messages the partner hasn't received yet
+	nsint fd = INVALID_SOCKET;
+	uint partner = 0;
+	double phase = 0.0;	// spreads out the sends of different clients
+	uint64 sendCount = 0;
+	uint8 mask[sizeof(uint32)];
+	bool webs = false;
+	bool waitOut = false;
+};
+
+// SETTINGS
+
+constexpr uint defaultClients = 1000;
+constexpr uint defaultWebsPercent = 50;
+constexpr double defaultRate = 10.0;
+constexpr uint defaultRecordEvery = 10;
+constexpr uint defaultRecordSize = 64;
+constexpr uint defaultSeconds = 10;
+constexpr int setupTimeout = 5000;
+constexpr std::chrono::seconds drainTimeout(2);
+constexpr char argAddress = 'a';	// server address (default is localhost)
+constexpr char argPort = 'p';	// server port
+constexpr char arg4 = '4';	// IPv4 only
+constexpr char arg6 = '6';	// IPv6 only
+constexpr char argClients = 'n';	// amount of clients, which get paired up into rooms
+constexpr char argWebs = 'w';	// percentage of WebSocket clients
+constexpr char argRate = 'r';	// messages per second per client
+constexpr char argRecordEvery = 'e';	// every nth message is a record (0 for only moves)
+constexpr char argRecordSize = 's';	// total size of a record message
+constexpr char argSeconds = 'd';	// duration of the traffic phase
+
+static std::atomic<bool> running = true;
+static double rate;
+static uint recordEvery;
+static uint recordSize;
+static vector<Client> clients;
+static umap<nsint, uint> clientIds;	// socket, index in clients
+static vector<nsint> backlog;
+static uptr<Poller> poller;
+static vector<uint32> latencies;	// relay times in nanoseconds
+static uint64 relayCount = 0, relayBytes = 0;
+
+static void eventExit(int) {
+	running = false;
+}
+
+// MESSAGES
+
+static void sendMessage(Client& cl, Code code, const uint8* payload, uint plen) {
+	static vector<uint8> data;
+	data.resize(dataHeadSize + plen);
+	data[0] = uint8(code);
+	write16(data.data() + 1, uint16(data.size()));
+	std::copy_n(payload, plen, data.data() + dataHeadSize);
+	if (!cl.webs) {
+		cl.outbox.write(cl.fd, data.data(), uint(data.size()));
+		return;
+	}
+
+	uint8 head[wsHeadMax] = { 0x82 };	// clients have to mask their frames
+	uint hlen = wsHeadMin;
+	if (data.size() <= 125)
+		head[1] = 0x80 | uint8(data.size());
+	else {
+		head[1] = 0x80 | 126;
+		write16(head + hlen, uint16(data.size()));
+		hlen += sizeof(uint16);
+	}
+	std::copy_n(cl.mask, sizeof(cl.mask), head + hlen);
+	hlen += sizeof(cl.mask);
+	unmaskData(data.data(), uint(data.size()), cl.mask);
+	cl.outbox.write(cl.fd, head, hlen, data.data(), uint(data.size()));
+}
+
+static uint8* awaitCode(Client& cl, Code code) {	// skips other messages until the code arrives (the result has to be cleared)
+	for (;;) {
+		while (uint8* data = cl.recvb.recv(cl.fd, cl.webs, &cl.outbox)) {
+			if (Code(data[0]) == code)
+				return data;
+			cl.recvb.clearCur(cl.webs);
+		}
+		if (!cl.outbox.empty() && !cl.outbox.flush(cl.fd))
+			continue;
+
+		pollfd pfd = { cl.fd, POLLIN, 0 };
+		if (int rc = poll(&pfd, 1, setupTimeout); rc <= 0)
+			throw Error(rc ? msgPollFail : "Timed out waiting for the server");
+		if (cl.recvb.recvData(cl.fd))
+			throw Error(msgConnectionLost);
+	}
+}
+
+static void upgradeWebSocket(Client& cl, std::mt19937& rng) {
+	string key(16, '\0');
+	for (char& it : key)
+		it = char(rng());
+	key = encodeBase64(key);
+	string request = "GET / HTTP/1.1\r\n"
+		"Host: thrones\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: " + key + "\r\n"
+		"Sec-WebSocket-Version: 13\r\n\r\n";
+	sendData(cl.fd, reinterpret_cast<const uint8*>(request.c_str()), uint(request.length()), false);
+
+	string response;
+	for (char buf[512]; response.find("\r\n\r\n") == string::npos;) {	// the server won't send anything else before the version check
+		pollfd pfd = { cl.fd, POLLIN, 0 };
+		long len;
+		if (poll(&pfd, 1, setupTimeout) <= 0 || (len = recv(cl.fd, buf, sizeof(buf), 0)) <= 0)
+			throw Error("Failed to upgrade to WebSocket");
+		response.append(buf, sizet(len));
+	}
+	if (response.compare(0, 12, "HTTP/1.1 101") || response.find(encodeBase64(digestSha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"))) == string::npos)
+		throw Error("Invalid WebSocket upgrade response");
+}
+
+// SETUP
+
+static void connectClient(Client& cl, const addrinfo* inf, std::mt19937& rng) {
+	for (const addrinfo* cur = inf; cur; cur = cur->ai_next) {
+		if (cl.fd = createSocket(cur->ai_family, 0); cl.fd == INVALID_SOCKET)
+			continue;
+#ifdef _WIN32
+		if (!connect(cl.fd, cur->ai_addr, socklent(cur->ai_addrlen)))
+#else
+		if (!connect(cl.fd, cur->ai_addr, cur->ai_addrlen))
+#endif
+			break;
+		closeSocket(cl.fd);
+	}
+	if (cl.fd == INVALID_SOCKET)
+		throw Error(msgConnectionFail);
+
+	writeMem(cl.mask, uint32(rng()));
+	if (cl.webs)
+		upgradeWebSocket(cl, rng);
+	sendVersion(cl.fd, cl.webs);
+	awaitCode(cl, Code::rlist);
+	cl.recvb.clearCur(cl.webs);
+}
+
+static void createRoom(uint id, const addrinfo* inf, std::mt19937& rng) {
+	Client& host = clients[id];
+	Client& guest = clients[id + 1];
+	string name = "load" + toStr(id / 2);
+	vector<uint8> room(1 + name.length());
+	room[0] = uint8(name.length());
+	std::copy(name.begin(), name.end(), room.begin() + 1);
+
+	connectClient(host, inf, rng);
+	sendMessage(host, Code::rnew, room.data(), uint(room.size()));
+	uint8* data = awaitCode(host, Code::cnrnew);
+	if (CncrnewCode(data[dataHeadSize]) != CncrnewCode::ok)
+		throw Error("Failed to create room " + name);
+	host.recvb.clearCur(host.webs);
+
+	connectClient(guest, inf, rng);
+	sendMessage(guest, Code::join, room.data(), uint(room.size()));
+	awaitCode(host, Code::hello);
+	host.recvb.clearCur(host.webs);
+	uint8 accept[] = { 1, 0 };	// yes + an empty config
+	sendMessage(host, Code::cnjoin, accept, sizeof(accept));
+	awaitCode(guest, Code::cnjoin);
+	guest.recvb.clearCur(guest.webs);
+
+	host.partner = id + 1;
+	guest.partner = id;
+}
+
+// TRAFFIC
+
+static void sendTraffic(double elapsed) {
+	static const vector<uint8> move(sizeof(uint16) * 2);
+	static const vector<uint8> record(recordSize - dataHeadSize);
+	steady_clock::time_point now = steady_clock::now();
+	for (Client& cl : clients)
+		for (uint64 target = uint64(rate * elapsed + cl.phase); cl.sendCount < target; ++cl.sendCount) {
+			const vector<uint8>& data = recordEvery && cl.sendCount % recordEvery == recordEvery - 1 ? record : move;
+			sendMessage(cl, &data == &record ? Code::record : Code::move, data.data(), uint(data.size()));
+			cl.sent.push_back(now);
+		}
+}
+
+static void receiveTraffic(Client& cl) {
+	steady_clock::time_point now = steady_clock::now();
+	for (uint8* data; (data = cl.recvb.recv(cl.fd, cl.webs, &cl.outbox)); cl.recvb.clearCur(cl.webs)) {
+		if (Code code = Code(data[0]); code != Code::move && code != Code::record)
+			throw Error("Unexpected message with code " + toStr(uint(code)));
+		Client& src = clients[cl.partner];
+		if (src.sent.empty())
+			throw Error("Received more messages than were sent");
+		latencies.push_back(uint32(std::min(std::chrono::duration_cast<std::chrono::nanoseconds>(now - src.sent.front()).count(), std::chrono::nanoseconds::rep(UINT32_MAX))));
+		src.sent.pop_front();
+		++relayCount;
+		relayBytes += readSize(data);
+	}
+}
+
+static bool pending() {
+	return std::any_of(clients.begin(), clients.end(), [](const Client& it) -> bool { return !it.sent.empty(); });
+}
+
+static void runTraffic(steady_clock::time_point start, steady_clock::time_point end) {
+	steady_clock::time_point report = start + std::chrono::seconds(1);
+	uint64 lastCount = relayCount, lastBytes = relayBytes;
+	for (steady_clock::time_point now = start; running && (now < end || (now < end + drainTimeout && pending())); now = steady_clock::now()) {
+		for (const Poller::Ready& it : poller->wait(1)) {
+			Client& cl = clients[clientIds.at(it.fd)];
+			if (it.events & Poller::EV_OUT && cl.outbox.flush(cl.fd)) {
+				poller->watchOut(cl.fd, false);
+				cl.waitOut = false;
+			}
+			if (it.events & Poller::EV_IN) {
+				bool fin = cl.recvb.recvData(cl.fd);
+				receiveTraffic(cl);
+				if (fin)
+					throw Error(msgConnectionLost);
+			} else if (it.events & Poller::EV_DISCONNECT)
+				throw Error(msgConnectionLost);
+		}
+		if (now < end)
+			sendTraffic(duration<double>(now - start).count());
+
+		for (nsint fd : backlog)
+			if (Client& cl = clients[clientIds.at(fd)]; !cl.outbox.empty() && !cl.waitOut) {
+				poller->watchOut(fd, true);
+				cl.waitOut = true;
+			}
+		backlog.clear();
+		if (now >= report) {
+			std::cout << uint(duration<double>(now - start).count() + 0.5) << "s: " << relayCount - lastCount << " messages/s, " << (relayBytes - lastBytes) / 1024 << " KiB/s" << std::endl;
+			lastCount = relayCount;
+			lastBytes = relayBytes;
+			report += std::chrono::seconds(1);
+		}
+	}
+}
+
+static void printReport(double seconds) {
+	uint64 sent = 0;
+	uint webs = 0;
+	for (const Client& it : clients) {
+		sent += it.sendCount;
+		webs += it.webs;
+	}
+	std::cout << linend << "clients: " << clients.size() << " (" << clients.size() - webs << " raw, " << webs << " websocket) in " << clients.size() / 2 << " rooms" << linend
+		<< "sent: " << sent << " messages in " << seconds << "s" << linend
+		<< "relayed: " << relayCount << " messages (" << uint64(double(relayCount) / seconds) << "/s), " << relayBytes << " bytes (" << uint64(double(relayBytes) / seconds / 1024.0) << " KiB/s)" << linend;
+	if (latencies.empty()) {
+		std::cout << "latency: no samples" << std::endl;
+		return;
+	}
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [](double p) -> double { return double(latencies[std::min(sizet(double(latencies.size()) * p), latencies.size() - 1)]) / 1000.0; };
+	std::cout << std::fixed << std::setprecision(1) << "latency in us: p50 " << percentile(0.5) << ", p99 " << percentile(0.99) << ", p999 " << percentile(0.999) << ", max " << double(latencies.back()) / 1000.0 << std::endl;
+}
+
+static void raiseFileLimit() {
+#ifndef _WIN32
+	if (rlimit lim; !getrlimit(RLIMIT_NOFILE, &lim) && lim.rlim_cur < lim.rlim_max) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+#endif
+}
+
+static int cleanup(int rc) {
+	for (Client& it : clients)
+		if (it.fd != INVALID_SOCKET)
+			closeSocket(it.fd);
+	clients.clear();
+	poller.reset();
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return rc;
+}
+
+#if defined(_WIN32) && !defined(__MINGW32__)
+int wmain(int argc, wchar** argv) {
+#else
+int main(int argc, char** argv) {
+#endif
+	signal(SIGINT, eventExit);
+	signal(SIGTERM, eventExit);
+	Arguments args(argc, argv, { arg4, arg6 }, { argAddress, argPort, argClients, argWebs, argRate, argRecordEvery, argRecordSize, argSeconds });
+	const char* addr = args.getOpt(argAddress);
+	const char* port = args.getOpt(argPort);
+	const char* clientCnt = args.getOpt(argClients);
+	const char* websPct = args.getOpt(argWebs);
+	const char* rateStr = args.getOpt(argRate);
+	const char* everyStr = args.getOpt(argRecordEvery);
+	const char* sizeStr = args.getOpt(argRecordSize);
+	const char* secStr = args.getOpt(argSeconds);
+	uint count = clientCnt ? std::max(uint(sstoul(clientCnt)) / 2 * 2, 2u) : defaultClients;
+	uint websPercent = websPct ? std::min(uint(sstoul(websPct)), 100u) : defaultWebsPercent;
+	rate = rateStr ? std::max(sstod(rateStr), 0.0) : defaultRate;
+	recordEvery = everyStr ? uint(sstoul(everyStr)) : defaultRecordEvery;
+	recordSize = sizeStr ? uint(std::clamp(sstoul(sizeStr), ulong(dataHeadSize), ulong(UINT16_MAX))) : defaultRecordSize;
+	uint seconds = secStr ? uint(sstoul(secStr)) : defaultSeconds;
+	int family = AF_UNSPEC;
+	if (args.hasFlag(arg4) && !args.hasFlag(arg6))
+		family = AF_INET;
+	else if (args.hasFlag(arg6) && !args.hasFlag(arg4))
+		family = AF_INET6;
+
+#ifdef _WIN32
+	if (WSADATA wsad; WSAStartup(MAKEWORD(2, 2), &wsad)) {
+		std::cerr << msgWinsockFail << std::endl;
+		return EXIT_FAILURE;
+	}
+#endif
+	raiseFileLimit();
+	addrinfo* inf = resolveAddress(addr ? addr : "localhost", port ? port : defaultPort, family);
+	if (!inf) {
+		std::cerr << msgResolveFail << std::endl;
+		return cleanup(EXIT_FAILURE);
+	}
+
+	try {
+		std::mt19937 rng(std::random_device{}());
+		std::uniform_real_distribution<double> phases(0.0, 1.0);
+		clients.resize(count);
+		for (uint i = 0; i < count; ++i) {
+			clients[i].webs = i * websPercent / 100 != (i + 1) * websPercent / 100;	// evenly spread out the WebSocket clients
+			clients[i].phase = phases(rng);
+		}
+
+		steady_clock::time_point start = steady_clock::now();
+		for (uint i = 0; running && i < count; i += 2)
+			createRoom(i, inf, rng);
+		freeaddrinfo(inf);
+		inf = nullptr;
+		if (!running)
+			return cleanup(EXIT_FAILURE);
+		std::cout << "set up " << count << " clients in " << uint(duration<double, std::milli>(steady_clock::now() - start).count()) << "ms" << std::endl;
+
+		poller = Poller::create();
+		for (uint i = 0; i < count; ++i) {
+			poller->add(clients[i].fd, false);
+			clients[i].outbox.setBacklog(&backlog);
+			if (!clients[i].outbox.empty())
+				backlog.push_back(clients[i].fd);
+			clientIds.emplace(clients[i].fd, i);
+		}
+		latencies.reserve(sizet(rate * seconds * count));
+		start = steady_clock::now();
+		runTraffic(start, start + std::chrono::seconds(seconds));
+		printReport(duration<double>(std::min(steady_clock::now(), start + std::chrono::seconds(seconds)) - start).count());
+	} catch (const Error& err) {
+		if (inf)
+			freeaddrinfo(inf);
+		std::cerr << err.what() << std::endl;
+		return cleanup(EXIT_FAILURE);
+	}
+	return cleanup(EXIT_SUCCESS);
+}
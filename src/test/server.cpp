@@ -1,5 +1,10 @@
 #include "tests.h"
 #include "server/server.h"
+#include "server/timer.h"
+#include <thread>
+#ifdef DEFLATE
+#include <zlib.h>
+#endif
 
 static void testWsKey() {
 	assertEqual(Com::encodeBase64(Com::digestSha1("dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11")), "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
@@ -8,6 +13,24 @@ static void testWsKey() {
 	assertEqual(Com::encodeBase64(Com::digestSha1("Iv8io/9s+lYFgZWcXczP8Q==258EAFA5-E914-47DA-95CA-C5AB0DC85B11")), "hsBlbuDTkk24srzEOTBUlZAlC2g=");
 }
 
+static void testSha1() {
+	assertEqual(Com::encodeBase64(Com::digestSha1("")), "2jmj7l5rSw0yVb/vlWAYkK/YBwk=");
+	assertEqual(Com::encodeBase64(Com::digestSha1("abc")), "qZk+NkcGgWq6PiVxeFDCbJzQ2J0=");
+	assertEqual(Com::encodeBase64(Com::digestSha1("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq")), "hJg+RBw70m66rkqh+VEp5eVGcPE=");
+	assertEqual(Com::encodeBase64(Com::digestSha1(string(64, 'a'))), "AJi6gktcFkJ716ESKlpEKiXsZE0=");
+	assertEqual(Com::encodeBase64(Com::digestSha1(string(1000, 'a'))), "KR6abGaZSUm1e6XmUDYemPw2sbo=");
+}
+
+static void testBase64() {
+	assertEqual(Com::encodeBase64(""), "");
+	assertEqual(Com::encodeBase64("f"), "Zg==");
+	assertEqual(Com::encodeBase64("fo"), "Zm8=");
+	assertEqual(Com::encodeBase64("foo"), "Zm9v");
+	assertEqual(Com::encodeBase64("foob"), "Zm9vYg==");
+	assertEqual(Com::encodeBase64("fooba"), "Zm9vYmE=");
+	assertEqual(Com::encodeBase64("foobar"), "Zm9vYmFy");
+}
+
 static void testReadCom() {
 	uint8 mem[] = { 0x10, 0x20, 0x40, 0x80, 0x01, 0x02, 0x04, 0x08 };
 	assertEqual(Com::read16(mem), 0x1020u);
@@ -74,13 +97,758 @@ static void testBufferWrite() {
 	assertMemory(&c[0], exp, 6);
 }
 
+static void testFrame() {
+	uint8 msg[] = { uint8(Com::Code::glmessage), 0, 5, 'h', 'i' };
+	Com::Frame f(msg, sizeof(msg));
+	uint8 wexp[] = { 0x82, 5, uint8(Com::Code::glmessage), 0, 5, 'h', 'i' };
+	assertEqual(f.getSize(false), uint(sizeof(msg)));
+	assertMemory(f.getData(false), msg, sizeof(msg));
+	assertEqual(f.getSize(true), uint(sizeof(wexp)));
+	assertMemory(f.getData(true), wexp, sizeof(wexp));
+
+	vector<uint8> big(300, 0xAB);
+	Com::Frame g(big.data(), uint(big.size()));
+	uint8 bexp[] = { 0x82, 126, 0x01, 0x2C };
+	assertEqual(g.getSize(true), uint(big.size() + sizeof(bexp)));
+	assertMemory(g.getData(true), bexp, sizeof(bexp));
+	assertMemory(g.getData(true) + sizeof(bexp), big.data(), big.size());
+}
+
+static void testUnmask() {
+	uint8 mask[] = { 0x12, 0x34, 0x56, 0x78 };
+	vector<uint8> data(200), exp(200);
+	for (uint len = 0; len < 100; ++len)
+		for (uint ofs = 0; ofs < 4; ++ofs) {	// also check unaligned starts
+			for (uint i = 0; i < len; ++i) {
+				data[ofs+i] = uint8(i * 7 + len);
+				exp[i] = data[ofs+i] ^ mask[i % 4];
+			}
+			Com::unmaskData(data.data() + ofs, len, mask);
+			assertMemory(data.data() + ofs, exp.data(), len);
+		}
+}
+
+static void testPool() {
+	assertEqual(Com::poolRound(1), Com::poolBlockMin);
+	assertEqual(Com::poolRound(Com::poolBlockMin + 1), Com::poolBlockMin * 2);
+	assertEqual(Com::poolRound(Com::poolBlockMax), Com::poolBlockMax);
+	assertEqual(Com::poolRound(Com::poolBlockMax + 1), Com::poolBlockMax + 1);
+
+	uint before = Com::poolStats()[1].used;
+	uint8* addr;
+	{
+		Com::PoolPtr blk = Com::poolAlloc(1000);
+		addr = blk.get();
+		assertEqual(Com::poolStats()[1].used, before + 1);
+		assertGreaterEqual(Com::poolStats()[1].blocks, Com::poolSlabSize / 1024);
+	}
+	assertEqual(Com::poolStats()[1].used, before);
+	assertEqual(Com::poolAlloc(1024).get(), addr);
+
+	uint large = Com::poolStats().back().used;
+	Com::PoolPtr big = Com::poolAlloc(Com::poolBlockMax * 2);
+	assertEqual(Com::poolStats().back().used, large + 1);
+	big.reset();
+	assertEqual(Com::poolStats().back().used, large);
+}
+
+static vector<uint8> recvAll(nsint fd) {
+	vector<uint8> data;
+	uint8 buf[4096];
+	for (long len; (len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0;)
+		data.insert(data.end(), buf, buf + len);
+	return data;
+}
+
+static void testSendData() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	vector<uint8> msg(300, 0x5A);
+	Com::sendData(fds[0], msg.data(), uint(msg.size()), true);
+	vector<uint8> data = recvAll(fds[1]);
+	uint8 exp[] = { 0x82, 126, 0x01, 0x2C };
+	assertEqual(data.size(), msg.size() + sizeof(exp));
+	assertMemory(data.data(), exp, sizeof(exp));
+	assertMemory(data.data() + sizeof(exp), msg.data(), msg.size());
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testOutbox() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	Com::Outbox out;
+	vector<uint8> sent;
+	for (uint i = 0; i < 64; ++i) {
+		vector<uint8> msg(4000 + i, uint8(i));
+		Com::Frame frame(msg.data(), uint(msg.size()));
+		Com::sendData(fds[0], out, msg.data(), uint(msg.size()), true);
+		out.write(fds[0], frame, false);
+		sent.insert(sent.end(), frame.getData(true), frame.getData(true) + frame.getSize(true));
+		sent.insert(sent.end(), msg.begin(), msg.end());
+	}
+	assertFalse(out.empty());
+
+	vector<uint8> data = recvAll(fds[1]);
+	for (bool done = false; !done;) {
+		done = out.flush(fds[0]);
+		vector<uint8> next = recvAll(fds[1]);
+		data.insert(data.end(), next.begin(), next.end());
+	}
+	assertTrue(out.empty());
+	assertEqual(out.getSize(), 0u);
+	assertEqual(data.size(), sent.size());
+	assertMemory(data.data(), sent.data(), sent.size());
+
+	Com::Outbox full;
+	full.setLimit(12);
+	full.setDeferred(true);
+	full.write(fds[0], sent.data(), 8);
+	bool failed = false;
+	try {
+		full.write(fds[0], sent.data(), 8);
+	} catch (const Com::Error&) {
+		failed = true;
+	}
+	assertTrue(failed);
+	assertEqual(full.getSize(), 8u);	// a rejected write doesn't count
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testOutboxFrames() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	for (bool webs : { false, true }) {
+		Com::Outbox out;
+		vector<Com::Frame> frames;
+		vector<uint8> sent;
+		for (uint i = 0; i < 100; ++i) {	// more than fit into one gathered send
+			vector<uint8> msg(10 + i, uint8(i));
+			frames.emplace_back(msg.data(), uint(msg.size()));
+			sent.insert(sent.end(), frames.back().getData(webs), frames.back().getData(webs) + frames.back().getSize(webs));
+		}
+		out.write(fds[0], frames, webs);
+		out.write(fds[0], frames, webs);
+		vector<uint8> once = sent;
+		sent.insert(sent.end(), once.begin(), once.end());
+
+		vector<uint8> data = recvAll(fds[1]);
+		for (bool done = false; !done;) {
+			done = out.flush(fds[0]);
+			vector<uint8> next = recvAll(fds[1]);
+			data.insert(data.end(), next.begin(), next.end());
+		}
+		assertEqual(data.size(), sent.size());
+		assertMemory(data.data(), sent.data(), sent.size());
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static vector<uint8> maskFrame(const vector<uint8>& msg) {
+	uint8 mask[] = { 0x12, 0x34, 0x56, 0x78 };
+	vector<uint8> frame = { 0x82, uint8(0x80 | msg.size()) };
+	frame.insert(frame.end(), mask, mask + sizeof(mask));
+	for (sizet i = 0; i < msg.size(); ++i)
+		frame.push_back(msg[i] ^ mask[i % sizeof(mask)]);
+	return frame;
+}
+
+static void testOutboxDeferred() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	vector<nsint> backlog;
+	Com::Outbox out;
+	out.setBacklog(&backlog);
+	out.setDeferred(true);
+	vector<uint8> msg = { 1, 2, 3, 4, 5, 6 };
+	Com::Frame frame(msg.data(), uint(msg.size()));
+	out.write(fds[0], msg.data(), uint(msg.size()));
+	out.write(fds[0], frame, false);
+	assertEqual(backlog.size(), 1u);
+	assertTrue(recvAll(fds[1]).empty());	// nothing goes out until the owner sends it
+
+	vector<uint8> gathered;
+	assertEqual(out.gather(1, [&gathered](uint i, const uint8* data, uint len, const sptr<uint8[]>&) {
+		assertEqual(i, 0u);
+		gathered.insert(gathered.end(), data, data + len);
+	}), 1u);
+	assertEqual(gathered.size(), msg.size());
+	assertMemory(gathered.data(), msg.data(), msg.size());
+	out.consume(uint(msg.size()) + 2);
+	assertEqual(out.getSize(), frame.getSize(false) - 2);
+	gathered.clear();
+	assertEqual(out.gather(8, [&gathered](uint, const uint8* data, uint len, const sptr<uint8[]>&) { gathered.insert(gathered.end(), data, data + len); }), 1u);
+	assertEqual(gathered.size(), frame.getSize(false) - 2);
+	assertMemory(gathered.data(), frame.getData(false) + 2, gathered.size());
+	out.consume(out.getSize());
+	assertTrue(out.empty());
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testBufferRecv() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	Com::Buffer b;
+	for (bool webs : { false, true }) {
+		vector<uint8> stream;
+		for (uint i = 0; i < 200; ++i) {
+			vector<uint8> msg = { uint8(Com::Code::move), 0, 7, uint8(i), 0, uint8(i), 0 };
+			vector<uint8> part = webs ? maskFrame(msg) : msg;
+			stream.insert(stream.end(), part.begin(), part.end());
+		}
+		for (uint pos = 0, cnt = 0; pos < stream.size(); pos += 301) {	// cut messages in between reads
+			assertEqual(write(fds[1], stream.data() + pos, std::min(sizet(301), stream.size() - pos)), long(std::min(sizet(301), stream.size() - pos)));
+			assertFalse(b.recvData(fds[0]));
+			for (uint8* data; (data = b.recv(fds[0], webs)); b.clearCur(webs), ++cnt) {
+				uint8 exp[] = { uint8(Com::Code::move), 0, 7, uint8(cnt), 0, uint8(cnt), 0 };
+				assertMemory(data, exp, sizeof(exp));
+			}
+		}
+	}
+
+	vector<uint8> ping = maskFrame({ 'p', 'i', 'n', 'g' });
+	ping[0] = 0x89;
+	assertEqual(write(fds[1], ping.data(), 8), 8l);	// a ping that's cut off mustn't block
+	assertFalse(b.recvData(fds[0]));
+	assertEqual(b.recv(fds[0], true), nullptr);
+	assertEqual(write(fds[1], ping.data() + 8, ping.size() - 8), long(ping.size() - 8));
+	assertFalse(b.recvData(fds[0]));
+	assertEqual(b.recv(fds[0], true), nullptr);
+	vector<uint8> pong = recvAll(fds[1]);
+	uint8 pexp[] = { 0x8A, 4, 'p', 'i', 'n', 'g' };
+	assertEqual(pong.size(), sizeof(pexp));
+	assertMemory(pong.data(), pexp, sizeof(pexp));
+	assertEqual(b.getDlim(), 0u);
+
+	uint8* data;
+	vector<uint8> msg = { uint8(Com::Code::message), 0, 5, 'h', 'i' };
+	vector<uint8> frame = maskFrame({});
+	frame[0] = 0x8A;
+	vector<uint8> part = maskFrame(msg);
+	frame.insert(frame.end(), part.begin(), part.end());
+	assertEqual(write(fds[1], frame.data(), frame.size()), long(frame.size()));	// data behind a pong doesn't wait for the next read
+	assertFalse(b.recvData(fds[0]));
+	assertFalse(b.takePong());
+	data = b.recv(fds[0], true);
+	assertTrue(b.takePong());
+	assertFalse(b.takePong());
+	assertMemory(data, msg.data(), msg.size());
+	b.clearCur(true);
+
+	frame = maskFrame(msg);
+	assertEqual(write(fds[1], frame.data(), frame.size()), long(frame.size()));
+	assertFalse(b.recvData(fds[0]));
+	Com::Outbox out;
+	data = b.recv(fds[0], true);
+	b.redirect(fds[1], out, data, true);
+	b.clearCur(true);
+	assertEqual(b.recv(fds[0], true), nullptr);
+	vector<uint8> fwd = recvAll(fds[0]);
+	uint8 exp[] = { 0x82, 5, uint8(Com::Code::message), 0, 5, 'h', 'i' };
+	assertEqual(fwd.size(), sizeof(exp));
+	assertMemory(fwd.data(), exp, sizeof(exp));
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testBufferRecvRun() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	vector<uint8> move = { uint8(Com::Code::move), 0, 7, 1, 2, 3, 4 };
+	vector<uint8> leave = { uint8(Com::Code::leave), 0, 3 };
+	vector<uint8> stream;
+	for (const vector<uint8>* it : { &move, &move, &leave, &move })
+		stream.insert(stream.end(), it->begin(), it->end());
+	assertEqual(write(fds[1], stream.data(), stream.size() - 1), long(stream.size() - 1));
+
+	Com::Buffer b;
+	uint len;
+	assertFalse(b.recvData(fds[0]));
+	uint8* run = b.recvRun(len, Com::Code::hello, Com::Code::message);
+	assertEqual(len, uint(move.size() * 2));
+	assertMemory(run, stream.data(), len);
+	b.clearRun(len);
+	assertEqual(b.recvRun(len, Com::Code::hello, Com::Code::message), nullptr);
+	assertMemory(b.recv(fds[0], false), leave.data(), leave.size());
+	b.clearCur(false);
+	assertEqual(b.recvRun(len, Com::Code::hello, Com::Code::message), nullptr);	// the last one isn't complete
+
+	assertEqual(write(fds[1], &stream.back(), 1), 1l);
+	assertFalse(b.recvData(fds[0]));
+	run = b.recvRun(len, Com::Code::hello, Com::Code::message);
+	assertEqual(len, uint(move.size()));
+	assertMemory(run, move.data(), len);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testOutboxConsume() {
+	Com::Outbox out;
+	out.setDeferred(true);
+	vector<uint8> sent, expect;
+	auto sendSome = [&out, &sent]() {	// sends a part of the first chunk, which may end in the middle of it
+		uint len = 0;
+		out.gather(1, [&sent, &len](uint, const uint8* data, uint clen, const sptr<uint8[]>&) {
+			len = std::min(clen, 5u);
+			sent.insert(sent.end(), data, data + len);
+		});
+		out.consume(len);
+	};
+	for (uint i = 0; i < 100; ++i) {
+		vector<uint8> msg(i % 7 + 1, uint8(i));
+		out.write(INVALID_SOCKET, msg.data(), uint(msg.size()));
+		expect.insert(expect.end(), msg.begin(), msg.end());
+		if (i % 3 == 2)
+			sendSome();
+	}
+	while (!out.empty())	// enough sent chunks pile up at the front to get erased
+		sendSome();
+	assertEqual(out.getSize(), 0u);
+	assertEqual(sent.size(), expect.size());
+	assertMemory(sent.data(), expect.data(), expect.size());
+}
+
+static void testBufferRecvBlock() {
+	vector<uint8> move = { uint8(Com::Code::move), 0, 7, 1, 2, 3, 4 };
+	Com::Buffer b;
+	Com::PoolPtr block = Com::poolAlloc(Com::Buffer::sizeStep);
+	uint8* mem = block.get();
+	std::copy(move.begin(), move.begin() + 4, mem);
+	b.recvData(block, 4);
+	assertEqual(b.getData(), mem);	// an empty buffer takes the block
+	assertTrue(block.get() != mem);
+
+	std::copy(move.begin() + 4, move.end(), block.get());
+	b.recvData(block, uint(move.size() - 4));
+	assertEqual(b.getData(), mem);
+	assertMemory(b.recv(INVALID_SOCKET, false), move.data(), move.size());
+	b.clearCur(false);
+}
+
+static void testBufferRecvPending() {
+	vector<uint8> msgs = { uint8(Com::Code::leave), 0, 3, uint8(Com::Code::move), 0, 7, 1, 2 };
+	Com::Buffer b;
+	b.recvData(msgs.data(), uint(msgs.size()));
+	assertTrue(b.recv(INVALID_SOCKET, false) != nullptr);
+	b.clearCur(false);
+	assertTrue(b.recv(INVALID_SOCKET, false) == nullptr);
+
+	uint len;
+	const uint8* rest = b.recvPending(len);
+	assertMemory(rest, msgs.data() + 3, msgs.size() - 3);	// only the incomplete message is left
+	vector<uint8> move = { uint8(Com::Code::move), 0, 7, 1, 2, 3, 4 };
+	Com::Buffer c;
+	c.recvData(rest, len);
+	c.recvData(move.data() + len, uint(move.size()) - len);
+	assertMemory(c.recv(INVALID_SOCKET, false), move.data(), move.size());
+}
+
+static vector<uint8> maskFragment(uint8 head, const uint8* msg, sizet len) {
+	uint8 mask[] = { 0x9A, 0xBC, 0xDE, 0xF0 };
+	vector<uint8> frame = { head, uint8(0x80 | (len > 125 ? 126 : len)) };
+	if (len > 125) {
+		frame.push_back(uint8(len >> 8));
+		frame.push_back(uint8(len));
+	}
+	frame.insert(frame.end(), mask, mask + sizeof(mask));
+	for (sizet i = 0; i < len; ++i)
+		frame.push_back(msg[i] ^ mask[i % sizeof(mask)]);
+	return frame;
+}
+
+static void testBufferFragments() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	vector<uint8> msg = { uint8(Com::Code::message), 0x01, 0x2C };
+	for (uint i = 0; msg.size() < 300; ++i)
+		msg.push_back(uint8(i));
+	vector<uint8> hi = { uint8(Com::Code::message), 0, 5, 'h', 'i' };
+	vector<uint8> ping = maskFrame({ 'p', 'i', 'n', 'g' });
+	ping[0] = 0x89;
+	vector<uint8> pong = maskFrame({});
+	pong[0] = 0x8A;
+	vector<vector<uint8>> parts = {
+		maskFragment(0x02, msg.data(), 2),	// shorter than the message header
+		ping,
+		maskFragment(0x00, msg.data() + 2, 198),
+		pong,
+		maskFragment(0x80, msg.data() + 200, 100),
+		maskFrame(hi)
+	};
+	vector<uint8> stream;
+	for (const vector<uint8>& it : parts)
+		stream.insert(stream.end(), it.begin(), it.end());
+
+	Com::Buffer b;
+	Com::Outbox out;
+	vector<vector<uint8>> got;
+	for (uint8 it : stream) {	// control frames between fragments get answered right away
+		b.recvData(&it, 1);
+		for (uint8* data; (data = b.recv(fds[0], true, &out)); b.clearCur(true))
+			got.emplace_back(data, data + Com::read16(data + 1));
+	}
+	assertEqual(got.size(), 2u);
+	assertTrue(got[0] == msg);
+	assertTrue(got[1] == hi);
+	assertTrue(b.takePong());
+	assertEqual(b.getDlim(), 0u);
+	vector<uint8> sent = recvAll(fds[1]);
+	uint8 pexp[] = { 0x8A, 4, 'p', 'i', 'n', 'g' };
+	assertEqual(sent.size(), sizeof(pexp));
+	assertMemory(sent.data(), pexp, sizeof(pexp));
+
+	b.recvData(stream.data(), uint(parts[0].size() + parts[1].size() + parts[2].size() + parts[3].size() + parts[4].size()));
+	uint8* data = b.recv(fds[0], true, &out);
+	assertTrue(data != nullptr);
+	b.redirect(fds[0], out, data, true);	// the joined message gets a header of its own
+	b.clearCur(true);
+	vector<uint8> fexp(pexp, pexp + sizeof(pexp));
+	uint8 fhead[] = { 0x82, 126, 0x01, 0x2C };
+	fexp.insert(fexp.end(), fhead, fhead + sizeof(fhead));
+	fexp.insert(fexp.end(), msg.begin(), msg.end());
+	assertTrue(recvAll(fds[1]) == fexp);
+
+	uint half = uint(parts[0].size() + parts[1].size() + parts[2].size() + 50);
+	b.recvData(stream.data(), half);
+	assertTrue(b.recv(fds[0], true, &out) == nullptr);
+	uint len;
+	const uint8* rest = b.recvPending(len);	// a partly joined message can still be handed over
+	Com::Buffer c;
+	c.recvData(rest, len);
+	c.recvData(stream.data() + half, uint(stream.size()) - half);
+	data = c.recv(fds[0], true, &out);
+	assertTrue(data != nullptr);
+	assertMemory(data, msg.data(), msg.size());
+	recvAll(fds[1]);
+
+	vector<uint8> frame = parts[0];
+	frame.push_back(0x88);
+	frame.push_back(0x80);
+	frame.insert(frame.end(), 4, 0);
+	Com::Buffer d;
+	d.recvData(frame.data(), uint(frame.size()));
+	bool closed = false;
+	try {
+		d.recv(fds[0], true, &out);
+	} catch (const Com::Error&) {
+		closed = true;
+	}
+	assertTrue(closed);
+	sent = recvAll(fds[1]);
+	assertEqual(sent.size(), 2u);
+	assertEqual(sent[0], 0x88);
+
+	frame = parts[2];	// a continuation without a start
+	Com::Buffer e;
+	e.recvData(frame.data(), uint(frame.size()));
+	closed = false;
+	try {
+		e.recv(fds[0], true, &out);
+	} catch (const Com::Error&) {
+		closed = true;
+	}
+	assertTrue(closed);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testBufferWide() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	Com::Buffer b;
+	uint8 head[] = { uint8(Com::Code::setup), 0, 0, 0x00, 0x01, 0x00, 0x04 };
+	assertEqual(b.pushHead(Com::Code::setup, UINT16_MAX + 1), uint(Com::wideHeadSize));
+	assertMemory(&b[0], head, sizeof(head));
+	b.clear();
+	assertEqual(b.allocate(Com::Code::setup, UINT16_MAX + 1), uint(Com::wideHeadSize));
+	assertEqual(b.getDlim(), uint(UINT16_MAX) + 1 + uint(sizeof(uint32)));
+	assertMemory(&b[0], head, sizeof(head));
+	assertEqual(Com::readSize(&b[0]), b.getDlim());
+	assertEqual(Com::readHeadSize(&b[0]), uint(Com::wideHeadSize));
+	b.clear();
+
+	uint8 text[] = { uint8(Com::Code::message), 0, 0, 0, 0, 0, 9, 'h', 'i' };	// a small message may also have a wide head
+	assertEqual(Com::readText(text), "hi");
+
+	vector<uint8> msg = { uint8(Com::Code::setup), 0, 0, 0x00, 0x01, 0x11, 0x70 };	// 70000 bytes
+	for (uint i = 0; msg.size() < 70000; ++i)
+		msg.push_back(uint8(i));
+	b.recvData(msg.data(), 5);
+	assertEqual(b.recv(fds[0], false), nullptr);	// the wide size hasn't arrived yet
+	b.recvData(msg.data() + 5, uint(msg.size() - 6));
+	assertEqual(b.recv(fds[0], false), nullptr);
+	b.recvData(&msg.back(), 1);
+	uint8* data = b.recv(fds[0], false);
+	assertTrue(data != nullptr);
+	assertMemory(data, msg.data(), msg.size());
+	b.clearCur(false);
+	assertEqual(b.getDlim(), 0u);
+
+	vector<uint8> stream = maskFragment(0x02, msg.data(), 60000), last = maskFragment(0x80, msg.data() + 60000, msg.size() - 60000);
+	stream.insert(stream.end(), last.begin(), last.end());
+	b.recvData(stream.data(), uint(stream.size()));
+	Com::Outbox out;
+	data = b.recv(fds[0], true, &out);
+	assertTrue(data != nullptr);
+	assertMemory(data, msg.data(), msg.size());
+	b.redirect(fds[1], out, data, true);	// the joined frame needs a 64 bit length
+	b.clearCur(true);
+	assertEqual(b.getDlim(), 0u);
+	vector<uint8> fwd;
+	while (fwd.size() < msg.size() + 10) {
+		vector<uint8> next = recvAll(fds[0]);
+		fwd.insert(fwd.end(), next.begin(), next.end());
+		out.flush(fds[1]);
+	}
+	uint8 fexp[] = { 0x82, 127, 0, 0, 0, 0, 0x00, 0x01, 0x11, 0x70 };
+	assertEqual(fwd.size(), msg.size() + sizeof(fexp));
+	assertMemory(fwd.data(), fexp, sizeof(fexp));
+	assertMemory(fwd.data() + sizeof(fexp), msg.data(), msg.size());
+
+	for (uint size : { uint(Com::wideHeadSize - 1), Com::dataSizeLimit + 1 }) {
+		uint8 bad[Com::wideHeadSize] = { uint8(Com::Code::setup) };
+		Com::write32(bad + Com::dataHeadSize, size);
+		Com::Buffer c;
+		c.recvData(bad, sizeof(bad));
+		bool failed = false;
+		try {
+			c.recv(fds[0], false);
+		} catch (const Com::Error&) {
+			failed = true;
+		}
+		assertTrue(failed);
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testHandoff() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	vector<uint8> data(100000);
+	for (sizet i = 0; i < data.size(); ++i)
+		data[i] = uint8(i);
+	vector<nsint> socks(300);	// more than fit into one message
+	for (nsint& it : socks)
+		it = dup(fds[0]);
+
+	std::thread sender(Com::sendHandoff, fds[0], data.data(), uint(data.size()), std::cref(socks));
+	vector<nsint> got;
+	vector<uint8> recv = Com::recvHandoff(fds[1], got);
+	sender.join();
+	assertTrue(recv == data);
+	assertEqual(got.size(), socks.size());
+	for (sizet i = 0; i < socks.size(); ++i) {
+		close(socks[i]);
+		close(got[i]);
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testTimerWheel() {
+	constexpr uint64 tick = TimerWheel::tickLen;
+	TimerWheel tw(1000 * tick);
+	uint a = tw.add(1, 1005 * tick);
+	tw.add(2, 1005 * tick + 1);	// rounds up to the next tick
+	uint c = tw.add(3, 1003 * tick);
+	tw.add(4, 1100 * tick);	// on the second level until tick 1088
+	tw.add(5, 6000 * tick);	// on the third level until tick 4096
+	assertEqual(tw.size(), 5u);
+	tw.cancel(c);
+	assertEqual(tw.size(), 4u);
+	assertTrue(tw.advance(1004 * tick).empty());
+
+	vector<nsint> due = tw.advance(1005 * tick);
+	assertEqual(due.size(), 1u);
+	assertEqual(due[0], 1);
+	assertEqual(tw.add(6, 1010 * tick), a);	// ids get reused
+	due = tw.advance(1006 * tick);
+	assertEqual(due.size(), 1u);
+	assertEqual(due[0], 2);
+	assertEqual(tw.size(), 3u);
+	due = tw.advance(1099 * tick);
+	assertEqual(due.size(), 1u);
+	assertEqual(due[0], 6);
+	due = tw.advance(1100 * tick);
+	assertEqual(due.size(), 1u);
+	assertEqual(due[0], 4);
+	assertTrue(tw.advance(5999 * tick).empty());
+	due = tw.advance(6000 * tick);
+	assertEqual(due.size(), 1u);
+	assertEqual(due[0], 5);
+	assertEqual(tw.size(), 0u);
+	tw.cancel(tw.add(7, 6001 * tick));
+	assertTrue(tw.advance(7000 * tick).empty());
+}
+
+static void testBufferRecvConn() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	for (uint i = 0; i <= Com::compatibleVersions.size(); ++i) {
+		string ver = i < Com::compatibleVersions.size() ? Com::compatibleVersions[i] : "0.0.0";
+		vector<uint8> msg = { uint8(Com::Code::version), 0, uint8(Com::dataHeadSize + ver.length()) };
+		msg.insert(msg.end(), ver.begin(), ver.end());
+		assertEqual(write(fds[1], msg.data(), msg.size()), long(msg.size()));
+
+		Com::Buffer b;
+		bool webs = false;
+		uint vid = UINT_MAX;
+		assertFalse(b.recvData(fds[0]));
+		if (i < Com::compatibleVersions.size()) {
+			assertTrue(b.recvConn(fds[0], webs, nullptr, &vid) == Com::Buffer::Init::connect);
+			assertEqual(vid, i);
+		} else
+			assertTrue(b.recvConn(fds[0], webs, nullptr, &vid) == Com::Buffer::Init::version);
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+#ifdef DEFLATE
+static vector<uint8> zlibStep(z_stream& zs, bool compress, const uint8* data, sizet len) {	// one message's worth of raw deflate data like a client makes or reads it
+	vector<uint8> res(65536), src(data, data + len);
+	if (!compress)
+		src.insert(src.end(), { 0x00, 0x00, 0xFF, 0xFF });
+	zs.next_in = src.data();
+	zs.avail_in = uInt(src.size());
+	zs.next_out = res.data();
+	zs.avail_out = uInt(res.size());
+	assertTrue(compress ? deflate(&zs, Z_SYNC_FLUSH) == Z_OK : inflate(&zs, Z_SYNC_FLUSH) == Z_OK);
+	res.resize(res.size() - zs.avail_out);
+	if (compress)
+		res.resize(res.size() - 4);	// without the sync flush tail
+	return res;
+}
+
+static void testDeflate() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	Com::Deflate::configure(64, false);
+	string response;
+	uptr<Com::Deflate> zip = Com::Deflate::negotiate("x-webkit-deflate-frame, permessage-deflate; server_max_window_bits=10, permessage-deflate; server_no_context_takeover; client_max_window_bits=9", response);
+	assertTrue(zip != nullptr);
+	assertEqual(response, string("Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; client_max_window_bits=9\r\n"));
+	assertTrue(zip->getMode().serverReset);
+	assertFalse(zip->getMode().clientReset);
+	assertTrue(Com::Deflate::negotiate("permessage-deflate; foo", response) == nullptr);
+
+	string handshake = "GET / HTTP/1.1\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n\r\n";
+	Com::Buffer b;
+	Com::Outbox out;
+	bool webs = false;
+	b.recvData(reinterpret_cast<const uint8*>(handshake.c_str()), uint(handshake.length()));
+	assertTrue(b.recvConn(fds[0], webs, &out) == Com::Buffer::Init::cont);
+	assertTrue(webs);
+	assertTrue(out.getDeflate() != nullptr);
+	vector<uint8> sent = recvAll(fds[1]);
+	assertTrue(string(sent.begin(), sent.end()).find("Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits=12\r\n") != string::npos);
+
+	vector<uint8> msg = { uint8(Com::Code::message), 0x01, 0x2C };
+	while (msg.size() < 300)
+		msg.push_back(uint8('a' + msg.size() % 7));
+	z_stream cinf{}, cdef{};
+	assertEqual(inflateInit2(&cinf, -15), Z_OK);
+	assertEqual(deflateInit2(&cdef, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12, 8, Z_DEFAULT_STRATEGY), Z_OK);
+	uint prev = UINT_MAX;
+	for (uint i = 0; i < 2; ++i) {	// the second one can refer to the first
+		Com::sendData(fds[0], out, msg.data(), uint(msg.size()), true);
+		sent = recvAll(fds[1]);
+		assertEqual(sent[0], 0xC2);
+		assertTrue(sent[1] < 126 && sent.size() == sent[1] + 2u && sent[1] < prev);
+		prev = sent[1];
+		assertTrue(zlibStep(cinf, false, &sent[2], sent.size() - 2) == msg);
+	}
+	vector<uint8> hi = { uint8(Com::Code::message), 0, 5, 'h', 'i' };
+	Com::sendData(fds[0], out, hi.data(), uint(hi.size()), true);
+	sent = recvAll(fds[1]);
+	assertEqual(sent[0], 0x82);	// too small to be worth it
+
+	for (uint i = 0; i < 2; ++i) {
+		vector<uint8> load = zlibStep(cdef, true, msg.data(), msg.size());
+		vector<uint8> frame = maskFragment(0xC2, load.data(), load.size());
+		vector<uint8> plain = maskFrame(hi);
+		frame.insert(frame.end(), plain.begin(), plain.end());
+		b.recvData(frame.data(), uint(frame.size()));
+		uint8* data = b.recv(fds[0], true, &out);
+		assertTrue(data != nullptr);
+		assertMemory(data, msg.data(), msg.size());
+		b.clearCur(true);
+		assertTrue((data = b.recv(fds[0], true, &out)) != nullptr);
+		assertMemory(data, hi.data(), hi.size());
+		b.clearCur(true);
+	}
+
+	vector<uint8> load = zlibStep(cdef, true, msg.data(), msg.size());
+	vector<uint8> frame = maskFragment(0x42, load.data(), 3);	// only the first fragment has RSV1
+	vector<uint8> part = maskFragment(0x80, load.data() + 3, load.size() - 3);
+	frame.insert(frame.end(), part.begin(), part.end());
+	b.recvData(frame.data(), uint(frame.size()));
+	uint8* data = b.recv(fds[0], true, &out);
+	assertTrue(data != nullptr);
+	assertMemory(data, msg.data(), msg.size());
+	b.clearCur(true);
+
+	string window = out.getDeflate()->getWindow();	// a new process can continue with the window
+	assertFalse(window.empty());
+	Com::Deflate next(out.getDeflate()->getMode());
+	next.setWindow(reinterpret_cast<const uint8*>(window.data()), uint(window.length()));
+	load = zlibStep(cdef, true, msg.data(), msg.size());
+	uint mlen;
+	const uint8* res = next.decompress(load.data(), uint(load.size()), mlen);
+	assertEqual(mlen, uint(msg.size()));
+	assertMemory(res, msg.data(), msg.size());
+
+	frame = maskFragment(0xC2, load.data(), load.size());	// a connection that didn't negotiate it can't send it
+	Com::Buffer c;
+	Com::Outbox plain;
+	c.recvData(frame.data(), uint(frame.size()));
+	bool failed = false;
+	try {
+		c.recv(fds[0], true, &plain);
+	} catch (const Com::Error&) {
+		failed = true;
+	}
+	assertTrue(failed);
+	inflateEnd(&cinf);
+	deflateEnd(&cdef);
+	close(fds[0]);
+	close(fds[1]);
+}
+#endif
+
 void testServer() {
 	puts("Running Server tests...");
 	testWsKey();
+	testSha1();
+	testBase64();
 	testReadCom();
 	testWriteCom();
 	testReadText();
 	testReadName();
 	testBufferPush();
 	testBufferWrite();
+	testBufferRecv();
+	testBufferRecvRun();
+	testBufferRecvBlock();
+	testBufferRecvPending();
+	testBufferFragments();
+	testBufferWide();
+	testBufferRecvConn();
+	testTimerWheel();
+	testFrame();
+	testUnmask();
+	testPool();
+	testSendData();
+	testOutbox();
+	testOutboxFrames();
+	testOutboxDeferred();
+	testOutboxConsume();
+	testHandoff();
+#ifdef DEFLATE
+	testDeflate();
+#endif
 }